@@ -0,0 +1,262 @@
+#include <benchmark/benchmark.h>
+#include <rest_rpc.hpp>
+
+using namespace rest_rpc;
+using namespace rpc_service;
+
+// In-process micro-benchmarks of the hot path of a request: codec, header parsing, router dispatch
+// and response packing, no socket is opened. Build with -DENABLE_BENCHMARK=ON, e.g.
+//   ./codec_router_bench --benchmark_filter=route --benchmark_format=json
+
+namespace {
+    struct person {
+        int id;
+        std::string name;
+        int age;
+
+        MSGPACK_DEFINE(id, name, age);
+    };
+
+    void ping(rpc_conn conn) {}
+
+    int add(rpc_conn conn, int a, int b) {
+        return a + b;
+    }
+
+    std::string echo(rpc_conn conn, const std::string& src) {
+        return src;
+    }
+
+    std::string get_person_name(rpc_conn conn, const person& p) {
+        return p.name;
+    }
+
+    struct dummy {
+        int add(rpc_conn conn, int a, int b) {
+            return a + b;
+        }
+    };
+
+    // router::route<T> calls its connection through T, this one keeps the response instead of
+    // queueing it for the socket
+    class bench_connection : public connection {
+    public:
+        bench_connection(boost::asio::io_service& ios, router& r, buffer_pool& buffers, admission_control& admission)
+            : connection(ios, 0, r, buffers, admission) {}
+
+        void response(uint64_t req_id, std::string data, request_type req_type = request_type::req_res) {
+            result = std::move(data);
+        }
+
+        std::string result;
+    };
+
+    struct route_fixture {
+        boost::asio::io_service ios;
+        router r;
+        buffer_pool buffers;
+        admission_control admission;
+        dummy d;
+        std::shared_ptr<bench_connection> conn;
+
+        explicit route_fixture(bool metrics = true) : conn(std::make_shared<bench_connection>(ios, r, buffers, admission)) {
+            r.enable_metrics(metrics);
+            r.register_handler<ExecMode::sync>("ping", ping);
+            r.register_handler<ExecMode::sync>("add", add);
+            r.register_handler<ExecMode::sync>("member_add", &dummy::add, &d);
+            r.register_handler<ExecMode::sync>("echo", echo);
+            r.register_handler<ExecMode::sync>("get_person_name", get_person_name);
+        }
+
+        void route(const buffer_type& request) {
+            r.route<bench_connection>(request.data(), request.size(), conn);
+        }
+    };
+}  // namespace
+
+static void BM_pack_args_int(benchmark::State& state) {
+    for (auto _ : state) {
+        auto buffer = msgpack_codec::pack_args("add", 1, 2);
+        benchmark::DoNotOptimize(buffer.data());
+    }
+}
+BENCHMARK(BM_pack_args_int);
+
+static void BM_pack_args_string(benchmark::State& state) {
+    std::string payload(state.range(0), 'a');
+    for (auto _ : state) {
+        auto buffer = msgpack_codec::pack_args("echo", payload);
+        benchmark::DoNotOptimize(buffer.data());
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_pack_args_string)->RangeMultiplier(16)->Range(16, 1 << 20);
+
+static void BM_pack_args_struct(benchmark::State& state) {
+    person p{ 1, "tom", 20 };
+    for (auto _ : state) {
+        auto buffer = msgpack_codec::pack_args("get_person_name", p);
+        benchmark::DoNotOptimize(buffer.data());
+    }
+}
+BENCHMARK(BM_pack_args_struct);
+
+static void BM_unpack_int(benchmark::State& state) {
+    auto buffer = msgpack_codec::pack_args("add", 1, 2);
+    msgpack_codec codec;
+    for (auto _ : state) {
+        auto tp = codec.unpack<std::tuple<std::string, int, int>>(buffer.data(), buffer.size());
+        benchmark::DoNotOptimize(tp);
+    }
+}
+BENCHMARK(BM_unpack_int);
+
+static void BM_unpack_string(benchmark::State& state) {
+    auto buffer = msgpack_codec::pack_args("echo", std::string(state.range(0), 'a'));
+    msgpack_codec codec;
+    for (auto _ : state) {
+        auto tp = codec.unpack<std::tuple<std::string, std::string>>(buffer.data(), buffer.size());
+        benchmark::DoNotOptimize(tp);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_unpack_string)->RangeMultiplier(16)->Range(16, 1 << 20);
+
+static void BM_unpack_struct(benchmark::State& state) {
+    auto buffer = msgpack_codec::pack_args("get_person_name", person{ 1, "tom", 20 });
+    msgpack_codec codec;
+    for (auto _ : state) {
+        auto tp = codec.unpack<std::tuple<std::string, person>>(buffer.data(), buffer.size());
+        benchmark::DoNotOptimize(tp);
+    }
+}
+BENCHMARK(BM_unpack_struct);
+
+static void BM_decode_head(benchmark::State& state) {
+    const bool v2 = state.range(0) != 0;
+    frame_header header{ 42, request_type::req_res, (uint8_t)(FLAG_METHOD_ID | FLAG_DEADLINE), 128, 7, 100 };
+    char head[HEAD_LEN_V2];
+    char trailer[32];
+    encode_head(header, v2, head);
+    encode_trailer(header, trailer);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(is_v2_head(head));
+        auto decoded = decode_head(head, v2);
+        if (v2) {
+            decode_trailer(trailer, decoded);
+        }
+        benchmark::DoNotOptimize(decoded);
+    }
+    state.SetLabel(v2 ? "v2" : "legacy");
+}
+BENCHMARK(BM_decode_head)->Arg(0)->Arg(1);
+
+static void BM_encode_head(benchmark::State& state) {
+    frame_header header{ 42, request_type::req_res, (uint8_t)(FLAG_METHOD_ID | FLAG_DEADLINE), 128, 7, 100 };
+    char head[HEAD_LEN_V2];
+    char trailer[32];
+    for (auto _ : state) {
+        auto len = encode_head(header, true, head) + encode_trailer(header, trailer);
+        benchmark::DoNotOptimize(len);
+        benchmark::ClobberMemory();
+    }
+}
+BENCHMARK(BM_encode_head);
+
+static void BM_method_id(benchmark::State& state) {
+    std::string name = "get_person_name";
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(method_id(name.data(), name.size()));
+    }
+}
+BENCHMARK(BM_method_id);
+
+static void BM_pack_response_int(benchmark::State& state) {
+    for (auto _ : state) {
+        auto result = msgpack_codec::pack_args_str(result_code::OK, 3);
+        benchmark::DoNotOptimize(result);
+    }
+}
+BENCHMARK(BM_pack_response_int);
+
+static void BM_pack_response_string(benchmark::State& state) {
+    std::string payload(state.range(0), 'a');
+    for (auto _ : state) {
+        auto result = msgpack_codec::pack_args_str(result_code::OK, payload);
+        benchmark::DoNotOptimize(result);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_pack_response_string)->RangeMultiplier(16)->Range(16, 1 << 20);
+
+static void BM_pack_response_head(benchmark::State& state) {
+    for (auto _ : state) {
+        auto head = msgpack_codec::pack_str_result_head(1 << 20);
+        benchmark::DoNotOptimize(head);
+    }
+}
+BENCHMARK(BM_pack_response_head);
+
+// range(0) enables the per-method metrics, to measure what they cost
+static void BM_route_void(benchmark::State& state) {
+    route_fixture f(state.range(0) != 0);
+    auto request = msgpack_codec::pack_args("ping");
+    for (auto _ : state) {
+        f.route(request);
+        benchmark::DoNotOptimize(f.conn->result);
+    }
+}
+BENCHMARK(BM_route_void)->Arg(0)->Arg(1);
+
+static void BM_route_add(benchmark::State& state) {
+    route_fixture f(state.range(0) != 0);
+    auto request = msgpack_codec::pack_args("add", 1, 2);
+    for (auto _ : state) {
+        f.route(request);
+        benchmark::DoNotOptimize(f.conn->result);
+    }
+}
+BENCHMARK(BM_route_add)->Arg(0)->Arg(1);
+
+static void BM_route_member_add(benchmark::State& state) {
+    route_fixture f(state.range(0) != 0);
+    auto request = msgpack_codec::pack_args("member_add", 1, 2);
+    for (auto _ : state) {
+        f.route(request);
+        benchmark::DoNotOptimize(f.conn->result);
+    }
+}
+BENCHMARK(BM_route_member_add)->Arg(0)->Arg(1);
+
+static void BM_route_struct(benchmark::State& state) {
+    route_fixture f;
+    auto request = msgpack_codec::pack_args("get_person_name", person{ 1, "tom", 20 });
+    for (auto _ : state) {
+        f.route(request);
+        benchmark::DoNotOptimize(f.conn->result);
+    }
+}
+BENCHMARK(BM_route_struct);
+
+static void BM_route_echo(benchmark::State& state) {
+    route_fixture f;
+    auto request = msgpack_codec::pack_args("echo", std::string(state.range(0), 'a'));
+    for (auto _ : state) {
+        f.route(request);
+        benchmark::DoNotOptimize(f.conn->result);
+    }
+    state.SetBytesProcessed(state.iterations() * state.range(0));
+}
+BENCHMARK(BM_route_echo)->RangeMultiplier(16)->Range(16, 1 << 20);
+
+static void BM_route_unknown(benchmark::State& state) {
+    route_fixture f;
+    auto request = msgpack_codec::pack_args("missing", 1);
+    for (auto _ : state) {
+        f.route(request);
+        benchmark::DoNotOptimize(f.conn->result);
+    }
+}
+BENCHMARK(BM_route_unknown);
+
+BENCHMARK_MAIN();
@@ -10,8 +10,30 @@ int main() {
     // test_multiple_thread(with_ssl);
     test_upload(with_ssl);
     test_download(with_ssl);
+    test_download_zero_copy(with_ssl);
+    test_buffer_release(with_ssl);
+    test_frame_limit(with_ssl);
+    test_internal_async_call(with_ssl);
+    test_read_backpressure(with_ssl);
+#if defined(REST_RPC_ENABLE_LZ4) || defined(REST_RPC_ENABLE_ZSTD)
+    test_compression(with_ssl);
+#endif
+    test_stream_upload(with_ssl);
+    test_stream_download(with_ssl);
     test_subscribe(with_ssl);
     test_get_latency(with_ssl);
+    test_batch(with_ssl);
+    test_oneway(with_ssl);
+    test_deadline(with_ssl);
+    test_overload(with_ssl);
+    test_cancel(with_ssl);
+    test_client_pool();
+    test_hedged_call();
+    test_coalescing(with_ssl);
+    test_stats(with_ssl);
+    test_trace(with_ssl);
+    test_flight_recorder(with_ssl);
+    test_shared_io_service(100, with_ssl);
     test_benchmark(with_ssl);
     test_sync_performance(with_ssl);
     test_async_performance(with_ssl);
@@ -1,7 +1,10 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <array>
 #include <chrono>
+#include <map>
+#include <set>
 
 #include <rest_rpc.hpp>
 
@@ -40,6 +43,24 @@ bool client_connect(rpc_client & client,
     return client.connect(host, port, is_ssl, timeout);
 }
 
+// the examples run against a live server, a failed check is reported and the test goes on
+void check(bool ok, const std::string& what) {
+    std::cout << (ok ? "ok: " : "FAILED: ") << what << std::endl;
+}
+
+// incompressible test payload, xorshift bytes
+std::string random_bytes(size_t size) {
+    std::string bytes(size, '\0');
+    uint32_t x = 2463534242u;
+    for (auto& c : bytes) {
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+        c = (char)x;
+    }
+    return bytes;
+}
+
 void test_connect(bool is_ssl=true) {
     std::cout << "test_connect start!" << std::endl;
 
@@ -238,6 +259,346 @@ void test_download(bool is_ssl=true) {
     std::cout << "test_download finished!" << std::endl;
 }
 
+void test_download_zero_copy(bool is_ssl=true) {
+    std::cout << "test_download_zero_copy start!" << std::endl;
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    // larger than the socket buffers, sendfile runs out of room and resumes once writable;
+    // with ssl the server reads the file into a buffer instead
+    auto content = random_bytes(8 * 1024 * 1024);
+
+    try {
+        client.call<5000>("upload", "zero_copy_file", content);
+        auto downloaded = client.call<5000, std::string>("download_zero_copy", "zero_copy_file");
+        check(downloaded == content, "download_zero_copy returns the " + std::to_string(content.size()) + " bytes of the file");
+
+        auto missing = client.call<std::string>("download_zero_copy", "no_such_file");
+        check(missing.empty(), "download_zero_copy of a missing file returns an empty string");
+    } catch (const std::exception& ex) {
+        check(false, std::string("download_zero_copy: ") + ex.what());
+    }
+
+    std::cout << "test_download_zero_copy finished!" << std::endl;
+}
+
+void test_frame_limit(bool is_ssl=true) {
+    std::cout << "test_frame_limit start!" << std::endl;
+
+    rpc_client uploader;
+    rpc_client client;
+    // the server answers this client with frames below 64 KB only
+    client.set_max_frame_size(64 * 1024);
+    if (!client_connect(uploader, is_ssl, 9000, "127.0.0.1") || !client_connect(client, is_ssl, 9000, "127.0.0.1")) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    try {
+        uploader.call<5000>("upload", "frame_limit_file", std::string(128 * 1024, 'f'));
+
+        std::string error;
+        try {
+            client.call<std::string>("download", "frame_limit_file");
+        } catch (const std::logic_error& ex) {
+            error = ex.what();
+        }
+        check(error.find("out of range") != std::string::npos, "a response over the negotiated frame size fails: " + error);
+        check(client.call<std::string>("echo", "still here") == "still here", "the connection survives the oversized response");
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_frame_limit: ") + ex.what());
+    }
+
+    std::cout << "test_frame_limit finished!" << std::endl;
+}
+
+void test_internal_async_call(bool is_ssl=true) {
+    std::cout << "test_internal_async_call start!" << std::endl;
+
+    // the results of the other language clients come back through one callback
+    std::mutex mtx;
+    std::condition_variable cv;
+    std::map<long, std::string> results;
+    rpc_client client(client_language_t::JAVA, [&](long id, const std::string& result) {
+        std::lock_guard<std::mutex> lock(mtx);
+        results[id] = result;
+        cv.notify_all();
+    });
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    auto small = msgpack_codec::pack_args(std::string("echo"), std::string("hello"));
+    auto big = msgpack_codec::pack_args(std::string("echo"), std::string(MAX_BUF_LEN, 'b'));
+    auto small_id = client.internal_async_call(std::string(small.data(), small.size()));
+    auto big_id = client.internal_async_call(std::string(big.data(), big.size()));
+
+    std::unique_lock<std::mutex> lock(mtx);
+    cv.wait_for(lock, std::chrono::seconds(3), [&] { return results.size() == 2; });
+    check(results.count(small_id) && !has_error(results[small_id]) && get_result<std::string>(results[small_id]) == "hello",
+        "internal_async_call gets its result");
+    check(results.count(big_id) && has_error(results[big_id]),
+        "an oversized internal_async_call fails through the callback: " + (results.count(big_id) ? get_error_msg(results[big_id]) : std::string("no result")));
+
+    std::cout << "test_internal_async_call finished!" << std::endl;
+}
+
+void test_buffer_release(bool is_ssl=true) {
+    std::cout << "test_buffer_release start!" << std::endl;
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    try {
+        // the body is borrowed from the server's buffer_pool and given back after the call
+        std::string big(1024 * 1024, 'b');
+        check(client.call<std::string>("echo", big) == big, "echo of a 1 MB body");
+
+        auto footprint = client.call<size_t>("buffer_footprint");
+        check(footprint < MAX_RETAINED_BUF_LEN, "the connection's footprint shrank back to " + std::to_string(footprint) + " bytes");
+
+        auto stats = client.call<server_stats>(STATS_RPC_NAME);
+        check(stats.values["receive_memory_bytes"] == 0, "no large receive buffer is in use any more");
+        check(stats.values["pooled_buffer_bytes"] >= big.size(), "the buffer went back to the pool");
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_buffer_release: ") + ex.what());
+    }
+
+    // 5 bodies of 9 MB in use at once are over the server's 40 MB receive memory limit
+    try {
+        auto before = client.call<server_stats>(STATS_RPC_NAME).values["receive_memory_rejected_total"];
+        std::string payload(9 * 1024 * 1024, 'g');
+        std::vector<std::future<req_result>> futures;
+        for (int i = 0; i < 5; ++i) {
+            futures.push_back(client.async_call<FUTURE>("hold_body", payload, 500));
+        }
+
+        size_t held = 0;
+        size_t overloaded = 0;
+        for (auto& future : futures) {
+            if (future.wait_for(std::chrono::seconds(5)) != std::future_status::ready) {
+                continue;
+            }
+
+            auto result = future.get();
+            if (result.overloaded()) {
+                overloaded++;
+            } else if (result.as<size_t>() == payload.size()) {
+                held++;
+            }
+        }
+        check(overloaded > 0 && held + overloaded == futures.size(),
+            std::to_string(overloaded) + " requests over the receive memory limit were answered OVERLOADED, " + std::to_string(held) + " ran");
+
+        auto after = client.call<server_stats>(STATS_RPC_NAME).values["receive_memory_rejected_total"];
+        check(after > before, "receive_memory_rejected_total went from " + std::to_string(before) + " to " + std::to_string(after));
+        check(client.call<std::string>("echo", "still here") == "still here", "the connection survives the rejected requests");
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_buffer_release: ") + ex.what());
+    }
+
+    std::cout << "test_buffer_release finished!" << std::endl;
+}
+
+#if defined(REST_RPC_ENABLE_LZ4) || defined(REST_RPC_ENABLE_ZSTD)
+void test_compression(bool is_ssl=true) {
+    std::cout << "test_compression start!" << std::endl;
+
+    rpc_client client;
+#ifdef REST_RPC_ENABLE_LZ4
+    client.set_compression(compress_type::lz4);
+#else
+    client.set_compression(compress_type::zstd);
+#endif
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    try {
+        // answered after the negotiate reply, which comes first on the connection
+        client.call<std::string>("echo", "hello");
+        check(client.compression() != compress_type::none, "the server negotiated a codec");
+
+        // well over COMPRESS_THRESHOLD, one compressible and one that isn't
+        std::string text;
+        for (int i = 0; text.size() < 1024 * 1024; ++i) {
+            text += "line " + std::to_string(i) + " of a compressible payload\n";
+        }
+        check(client.call<std::string>("echo", text) == text, "a compressed " + std::to_string(text.size()) + " bytes payload round-trips");
+
+        auto noise = random_bytes(256 * 1024);
+        check(client.call<std::string>("echo", noise) == noise, "an incompressible payload round-trips");
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_compression: ") + ex.what());
+    }
+
+    std::cout << "test_compression finished!" << std::endl;
+}
+#endif
+
+void test_read_backpressure(bool is_ssl=true) {
+    std::cout << "test_read_backpressure start!" << std::endl;
+    if (is_ssl) {
+        std::cout << "test_read_backpressure needs a plain connection" << std::endl;
+        return;
+    }
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    try {
+        const size_t file_size = 4 * 1024 * 1024;
+        client.call<5000>("upload", "backpressure_file", std::string(file_size, 'p'));
+        auto before = client.call<server_stats>(STATS_RPC_NAME).values["read_pauses_total"];
+
+        // a peer sending legacy frames that doesn't read its responses for a while
+        boost::asio::io_service ios;
+        boost::asio::ip::tcp::socket socket(ios);
+        socket.connect(boost::asio::ip::tcp::endpoint(boost::asio::ip::address::from_string("127.0.0.1"), 9000));
+        uint64_t req_id = 0;
+        auto send = [&socket, &req_id](const std::string& rpc_name, const std::string& arg) {
+            auto buf = msgpack_codec::pack_args(rpc_name, arg);
+            rpc_header header{ (uint32_t)buf.size(), ++req_id, request_type::req_res };
+            std::array<boost::asio::const_buffer, 2> bufs{ { boost::asio::buffer(&header, sizeof(header)),
+                boost::asio::buffer(buf.data(), buf.size()) } };
+            boost::asio::write(socket, bufs);
+        };
+
+        // 64 MB of responses, over the server's 32 MB high water mark
+        for (int i = 0; i < 16; ++i) {
+            send("download", "backpressure_file");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        // left in the socket while the server doesn't read
+        for (int i = 0; i < 4; ++i) {
+            send("echo", "after the pause");
+        }
+
+        size_t downloads = 0;
+        size_t echoes = 0;
+        for (uint64_t i = 0; i < req_id; ++i) {
+            rpc_header header;
+            boost::asio::read(socket, boost::asio::buffer(&header, sizeof(header)));
+            std::string body(header.body_len, '\0');
+            boost::asio::read(socket, boost::asio::buffer(&body[0], body.size()));
+
+            msgpack_codec codec;
+            auto tp = codec.unpack<std::tuple<int, std::string>>(body.data(), body.size());
+            auto& result = std::get<1>(tp);
+            if (result.size() == file_size) {
+                downloads++;
+            } else if (result == "after the pause") {
+                echoes++;
+            }
+        }
+        check(downloads == 16 && echoes == 4, "every response arrived once the peer read again");
+
+        auto after = client.call<server_stats>(STATS_RPC_NAME).values["read_pauses_total"];
+        check(after > before, "read_pauses_total went from " + std::to_string(before) + " to " + std::to_string(after));
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_read_backpressure: ") + ex.what());
+    }
+
+    std::cout << "test_read_backpressure finished!" << std::endl;
+}
+
+void test_stream_upload(bool is_ssl=true) {
+    std::cout << "test_stream_upload start!" << std::endl;
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    // several windows worth, the writer has to wait for acks
+    auto content = random_bytes(4 * 1024 * 1024);
+    auto stream = client.open_stream("upload_stream", "upload_stream_file");
+    bool written = true;
+    for (size_t offset = 0; offset < content.size() && written; offset += STREAM_CHUNK_SIZE) {
+        written = stream->write(string_view(content.data() + offset, (std::min)(STREAM_CHUNK_SIZE, content.size() - offset)));
+    }
+    stream->finish();
+
+    std::string reply;
+    while (stream->read(reply)) {
+    }
+    check(written && !stream->has_error(), "the stream upload finished: " + (stream->has_error() ? stream->error_message() : std::string("ok")));
+
+    try {
+        check(client.call<5000, std::string>("download", "upload_stream_file") == content,
+            "the server wrote the " + std::to_string(content.size()) + " streamed bytes");
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_stream_upload: ") + ex.what());
+    }
+
+    std::cout << "test_stream_upload finished!" << std::endl;
+}
+
+void test_stream_download(bool is_ssl=true) {
+    std::cout << "test_stream_download start!" << std::endl;
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    auto content = random_bytes(4 * 1024 * 1024);
+    try {
+        client.call<5000>("upload", "download_stream_file", content);
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_stream_download: ") + ex.what());
+        return;
+    }
+
+    auto stream = client.open_stream("download_stream", "download_stream_file");
+    stream->finish();
+
+    std::string downloaded;
+    std::string chunk;
+    if (stream->read(chunk)) {
+        downloaded += chunk;
+        // the server stops once the window is used up, whatever the size of the file
+        std::this_thread::sleep_for(std::chrono::milliseconds(500));
+        check(stream->queued_bytes() <= STREAM_WINDOW,
+            std::to_string(stream->queued_bytes()) + " bytes arrived while the reader paused, the window is " + std::to_string(STREAM_WINDOW));
+    }
+    while (stream->read(chunk)) {
+        downloaded += chunk;
+    }
+    check(!stream->has_error(), "the stream download finished: " + (stream->has_error() ? stream->error_message() : std::string("ok")));
+    check(downloaded == content, "the " + std::to_string(downloaded.size()) + " downloaded bytes are the file");
+
+    auto missing = client.open_stream("download_stream", "no_such_file");
+    missing->finish();
+    while (missing->read(chunk)) {
+    }
+    check(missing->has_error() && missing->error_message().find("no such file") != std::string::npos,
+        "a stream download of a missing file fails: " + missing->error_message());
+
+    std::cout << "test_stream_download finished!" << std::endl;
+}
+
 void wait_for_notification(rpc_client & client) {
     client.async_call<0>("sub", [&client](const boost::system::error_code &ec, string_view data) {
         auto str = as<std::string>(data);
@@ -461,6 +822,9 @@ void test_benchmark(bool is_ssl=true){
         return;
     }
 
+    // the calls below wait for room instead of queueing 400k requests at once
+    client.set_max_inflight(20000, 64 * 1024 * 1024);
+
     {
         for (size_t i = 0; i < 10000; i++) {
             client.async_call<100>("echo",
@@ -576,6 +940,537 @@ void test_async_performance(bool is_ssl=true) {
     std::cout << "test_async_performance finished!" << std::endl;
 }
 
+void test_batch(bool is_ssl=true) {
+    std::cout << "test_batch start!" << std::endl;
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    try {
+        // a failing call in the middle keeps its own error, the ones after it still run
+        auto batch = client.batch();
+        batch.add("echo", "batch echo").add("unknown").add("get_person").add("add", 1, 2);
+        auto results = batch.call();
+        check(results.size() == 4, std::to_string(results.size()) + " results for 4 batched calls");
+        if (results.size() == 4) {
+            check(results[0].as<std::string>() == "batch echo", "the first batched call's result");
+            check(!results[1].success(), "the unknown rpc fails on its own");
+            check(results[2].as<person>().name == "tom", "the call after the failing one ran");
+            check(results[3].as<int>() == 3, "the last batched call's result");
+        }
+    } catch (const std::exception & ex) {
+        check(false, std::string("test_batch: ") + ex.what());
+    }
+
+    std::cout << "test_batch finished!" << std::endl;
+}
+
+void test_oneway(bool is_ssl=true) {
+    std::cout << "test_oneway start!" << std::endl;
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    try {
+        auto before = client.call<size_t>("ingested_logs");
+        auto written = client.call<server_stats>(STATS_RPC_NAME).values["written_messages_total"];
+        const size_t n = 100000;
+        size_t sent = 0;
+        for (size_t i = 0; i < n; i++) {
+            if (client.call_oneway("ingest_log", "log line " + std::to_string(i))) {
+                sent++;
+            }
+        }
+        check(sent == n, std::to_string(sent) + " oneway calls sent");
+
+        // all of them were read once a normal call after them returns, the workers may still run some
+        size_t ingested = 0;
+        for (int i = 0; i < 100 && ingested < n; i++) {
+            ingested = client.call<size_t>("ingested_logs") - before;
+            if (ingested < n) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(50));
+            }
+        }
+        check(ingested == n, "the server ran " + std::to_string(ingested) + " of the " + std::to_string(n) + " oneway calls");
+
+        // only the responses of the few normal calls here, on this and the other connections
+        auto responses = client.call<server_stats>(STATS_RPC_NAME).values["written_messages_total"] - written;
+        check(responses < 1000, std::to_string(responses) + " responses were written meanwhile, none for the oneway calls");
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_oneway: ") + ex.what());
+    }
+
+    std::cout << "test_oneway finished!" << std::endl;
+}
+
+void test_deadline(bool is_ssl=true) {
+    std::cout << "test_deadline start!" << std::endl;
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    try {
+        // the 100ms timeout is sent along, the server stops slow_query after about 10 of its 100 steps
+        bool timed_out = false;
+        try {
+            client.call<100, std::string>("slow_query", 100);
+        } catch (const std::exception&) {
+            timed_out = true;
+        }
+        check(timed_out, "the call timed out on the client");
+
+        // the whole query would take a second
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        auto steps = client.call<int>("slow_query_steps");
+        check(steps < 50, "the server stopped slow_query after " + std::to_string(steps) + " of 100 steps");
+
+        check(client.call<std::string>("slow_query", 5) == "done", "a query within its deadline completes");
+        check(client.call<int>("slow_query_steps") == 5, "and runs all its steps");
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_deadline: ") + ex.what());
+    }
+
+    std::cout << "test_deadline finished!" << std::endl;
+}
+
+void test_overload(bool is_ssl=true) {
+    std::cout << "test_overload start!" << std::endl;
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    std::vector<std::future<req_result>> futures;
+    for (size_t i = 0; i < 20; i++) {
+        futures.push_back(client.async_call<FUTURE>("slow_query", 5));
+    }
+
+    size_t overloaded = 0;
+    size_t done = 0;
+    for (auto& future : futures) {
+        auto result = future.get();
+        if (result.overloaded()) {
+            overloaded++;
+        } else if (result.success()) {
+            done++;
+        }
+    }
+
+    // slow_query runs at most 4 at once on the server
+    check(overloaded > 0 && overloaded < 20, std::to_string(overloaded) + " of 20 concurrent calls were rejected");
+    check(overloaded + done == 20, "the others completed");
+    std::cout << "test_overload finished!" << std::endl;
+}
+
+void test_cancel(bool is_ssl=true) {
+    std::cout << "test_cancel start!" << std::endl;
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    try {
+        auto before = client.call<size_t>("cancelled_queries");
+
+        // both queries would run for a second, they are cancelled while running
+        uint64_t req_id = 0;
+        auto future = client.async_call_cancellable(req_id, 0, "cancellable_query", 100);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        check(client.cancel(req_id), "the future call was cancelled");
+        auto result = future.get();
+        check(!result.success(), "its future fails");
+        try {
+            result.as();
+        } catch (const std::logic_error& ex) {
+            check(std::string(ex.what()) == "request cancelled", std::string("with the cancel result: ") + ex.what());
+        }
+
+        auto aborted = std::make_shared<std::promise<boost::system::error_code>>();
+        auto callback_ec = aborted->get_future();
+        req_id = client.async_call("cancellable_query", [aborted](boost::system::error_code ec, string_view data) {
+            aborted->set_value(ec);
+        }, 100);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+        check(client.cancel(req_id), "the callback call was cancelled");
+        check(callback_ec.wait_for(std::chrono::seconds(1)) == std::future_status::ready &&
+            callback_ec.get() == boost::asio::error::operation_aborted, "its callback got operation_aborted");
+
+        // the handler sees it at its next step
+        size_t cancelled = 0;
+        for (int i = 0; i < 20 && cancelled < 2; i++) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            cancelled = client.call<size_t>("cancelled_queries") - before;
+        }
+        check(cancelled == 2, "the server handler saw " + std::to_string(cancelled) + " of the 2 cancellations");
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_cancel: ") + ex.what());
+    }
+
+    std::cout << "test_cancel finished!" << std::endl;
+}
+
+void test_coalescing(bool is_ssl=true) {
+    std::cout << "test_coalescing start!" << std::endl;
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    // many tiny pipelined calls, the server holds their responses and writes them together
+    const size_t n = 2000;
+    std::vector<std::future<req_result>> futures;
+    for (size_t i = 0; i < n; i++) {
+        futures.push_back(client.async_call<FUTURE>("echo", std::to_string(i)));
+    }
+
+    size_t matched = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (futures[i].wait_for(std::chrono::seconds(5)) == std::future_status::ready &&
+            futures[i].get().as<std::string>() == std::to_string(i)) {
+            matched++;
+        }
+    }
+    check(matched == n, "every coalesced response reaches its own call: " + std::to_string(matched) + " of " + std::to_string(n));
+
+    auto stats = client.call<server_stats>(STATS_RPC_NAME);
+    auto max_batch = stats.values["max_write_batch"];
+    check(max_batch > 1, "responses were coalesced, largest write " + std::to_string(max_batch) + " responses");
+    std::cout << "test_coalescing finished!" << std::endl;
+}
+
+// the echo entry of a __stats result and the count of its total latency histogram
+method_summary echo_summary(const server_stats& stats, uint64_t& total_count, uint64_t& total_p99) {
+    method_summary echo{ "echo", 0, 0, 0, 0, {} };
+    for (auto& m : stats.methods) {
+        if (m.name == "echo") {
+            echo = m;
+        }
+    }
+
+    total_count = 0;
+    total_p99 = 0;
+    for (auto& phase : echo.phases) {
+        if (phase.phase == "total") {
+            total_count = phase.count;
+            total_p99 = phase.p99_ns;
+        }
+    }
+    return echo;
+}
+
+void test_stats(bool is_ssl=true) {
+    std::cout << "test_stats start!" << std::endl;
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    try {
+        auto before = client.call<server_stats>(STATS_RPC_NAME);
+        for (size_t i = 0; i < 10; i++) {
+            client.call<std::string>("echo", "stats");
+        }
+        auto after = client.call<server_stats>(STATS_RPC_NAME);
+        for (auto& v : after.values) {
+            std::cout << v.first << ": " << v.second << std::endl;
+        }
+
+        uint64_t count_before = 0;
+        uint64_t count_after = 0;
+        uint64_t p99_before = 0;
+        uint64_t p99 = 0;
+        auto echo_before = echo_summary(before, count_before, p99_before);
+        auto echo_after = echo_summary(after, count_after, p99);
+        check(echo_after.calls >= echo_before.calls + 10, "echo calls went from " + std::to_string(echo_before.calls) + " to " + std::to_string(echo_after.calls));
+        check(echo_after.request_bytes > echo_before.request_bytes && echo_after.response_bytes > echo_before.response_bytes,
+            "echo's request and response bytes moved");
+        check(count_after >= count_before + 10 && p99 > 0, "echo's total latency histogram counted them, p99 " + std::to_string(p99) + "ns");
+        check(after.values["written_messages_total"] >= before.values["written_messages_total"] + 10, "written_messages_total moved");
+        check(after.values["connections"] >= 1, std::to_string(after.values["connections"]) + " open connections");
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_stats: ") + ex.what());
+    }
+
+    std::cout << "test_stats finished!" << std::endl;
+}
+
+void test_trace(bool is_ssl=true) {
+    std::cout << "test_trace start!" << std::endl;
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    try {
+        // the server records its spans of these calls in its own process
+        get_tracer().collect();
+        get_tracer().set_sample_rate(1.0);
+        for (size_t i = 0; i < 10; i++) {
+            client.call<std::string>("echo", "traced");
+        }
+        get_tracer().set_sample_rate(0);
+
+        std::set<uint64_t> client_traces;
+        for (auto& span : get_tracer().collect()) {
+            if (span.kind == span_kind::client_call) {
+                client_traces.insert(span.trace_id);
+            }
+        }
+        check(client_traces.size() == 10, std::to_string(client_traces.size()) + " client spans for 10 traced calls");
+
+        auto ids = client.call<std::vector<uint64_t>>("server_trace_ids");
+        std::set<uint64_t> server_traces(ids.begin(), ids.end());
+        size_t matched = 0;
+        for (auto id : client_traces) {
+            matched += server_traces.count(id);
+        }
+        check(matched == client_traces.size(), "the server recorded a span of " + std::to_string(matched) + " of them with the same trace id");
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_trace: ") + ex.what());
+    }
+
+    std::cout << "test_trace finished!" << std::endl;
+}
+
+void test_flight_recorder(bool is_ssl=true) {
+    std::cout << "test_flight_recorder start!" << std::endl;
+
+    rpc_client client;
+    bool r = client_connect(client, is_ssl, 9000, "127.0.0.1");
+    if (!r) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    try {
+        client.call<std::string>("echo", "recorded");
+
+        // the binary dump, the json one of every thread's ring can be over the max frame size
+        auto dump = client.call<std::string>(FLIGHT_RECORDER_RPC_NAME, "binary");
+        const size_t magic_len = sizeof(FLIGHT_RECORDER_MAGIC) - 1;
+        uint64_t count = 0;
+        bool valid = dump.size() >= magic_len + sizeof(count) && dump.compare(0, magic_len, FLIGHT_RECORDER_MAGIC) == 0;
+        if (valid) {
+            memcpy(&count, dump.data() + magic_len, sizeof(count));
+            valid = dump.size() == magic_len + sizeof(count) + count * sizeof(flight_event);
+        }
+        check(valid, "the dump holds " + std::to_string(count) + " events");
+
+        std::vector<flight_event> events(valid ? count : 0);
+        if (!events.empty()) {
+            memcpy(events.data(), dump.data() + magic_len + sizeof(count), events.size() * sizeof(flight_event));
+        }
+
+        auto echo_id = method_id("echo", 4);
+        bool dispatched = false;
+        bool completed = false;
+        for (auto& e : events) {
+            if (e.method_id == echo_id) {
+                dispatched = dispatched || e.phase == flight_phase::dispatched;
+                completed = completed || e.phase == flight_phase::completed;
+            }
+        }
+        check(dispatched && completed, "the echo call was recorded as dispatched and completed");
+
+        // open it in chrome://tracing
+        auto trace = flight_recorder::to_chrome_trace(events, { { echo_id, "echo" } });
+        check(trace.find("\"name\":\"dispatched\"") != std::string::npos && trace.find("\"method\":\"echo\"") != std::string::npos,
+            "the Chrome trace has the echo events");
+        std::ofstream file("flight_recorder.json", std::ios::binary);
+        file.write(trace.data(), trace.size());
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_flight_recorder: ") + ex.what());
+    }
+
+    std::cout << "test_flight_recorder finished!" << std::endl;
+}
+
+void test_client_pool() {
+    std::cout << "test_client_pool start!" << std::endl;
+
+    const balance_policy policies[] = { balance_policy::round_robin, balance_policy::least_outstanding,
+                                        balance_policy::power_of_two };
+    const char* names[] = { "round_robin", "least_outstanding", "power_of_two" };
+    for (size_t p = 0; p < 3; p++) {
+        rpc_client_pool pool(2, policies[p]);
+        pool.add_endpoint("127.0.0.1", 9000, 3);
+        // nothing listens there, the policies skip this connection
+        pool.add_endpoint("127.0.0.1", 9001, 1);
+        if (!pool.connect(1)) {
+            std::cout << "connect failed!" << std::endl;
+            return;
+        }
+
+        std::map<rpc_client*, size_t> picks;
+        bool picked_disconnected = false;
+        for (size_t i = 0; i < 300; i++) {
+            auto client = pool.get_client();
+            picked_disconnected |= !client->has_connected();
+            picks[client.get()]++;
+        }
+        check(!picked_disconnected, std::string(names[p]) + " never picks the disconnected client");
+        if (policies[p] != balance_policy::power_of_two) {
+            check(picks.size() == 3, std::string(names[p]) + " spreads the calls over the 3 connected clients");
+        }
+
+        // each pending slow_query counts against its client
+        std::set<rpc_client*> busy;
+        std::vector<std::future<req_result>> futures;
+        for (size_t i = 0; i < 3; i++) {
+            auto client = pool.get_client();
+            busy.insert(client.get());
+            futures.push_back(client->async_call<FUTURE>("slow_query", 5));
+        }
+        if (policies[p] == balance_policy::least_outstanding) {
+            check(busy.size() == 3, "least_outstanding sends concurrent calls to distinct clients");
+        }
+        for (auto& future : futures) {
+            check(future.get().as<std::string>() == "done", std::string(names[p]) + " slow_query through the pool");
+        }
+
+        check(pool.call<std::string>("echo", "pool") == "pool", std::string(names[p]) + " call through the pool");
+    }
+
+    std::cout << "test_client_pool finished!" << std::endl;
+}
+
+void test_hedged_call() {
+    std::cout << "test_hedged_call start!" << std::endl;
+
+    rpc_client_pool pool(1);
+    pool.add_endpoint("127.0.0.1", 9000, 2);
+    if (!pool.connect()) {
+        std::cout << "connect failed!" << std::endl;
+        return;
+    }
+
+    // hedge after 20ms, whatever the latencies seen
+    hedge_policy policy;
+    policy.min_delay = std::chrono::milliseconds(20);
+    policy.max_delay = std::chrono::milliseconds(20);
+    pool.set_hedge_policy(policy);
+
+    try {
+        // one of the two connections answers after 500ms
+        pool.get_client()->call<void>("set_connection_delay", 500);
+
+        size_t answered = 0;
+        auto slowest = std::chrono::steady_clock::duration::zero();
+        for (size_t i = 0; i < 20; i++) {
+            auto start = std::chrono::steady_clock::now();
+            auto future = pool.async_hedged_call("delayed_echo", "hedged " + std::to_string(i));
+            if (future.get().as<std::string>() == "hedged " + std::to_string(i)) {
+                answered++;
+            }
+            slowest = (std::max)(slowest, std::chrono::steady_clock::now() - start);
+        }
+
+        auto slowest_ms = std::chrono::duration_cast<std::chrono::milliseconds>(slowest).count();
+        check(answered == 20, std::to_string(answered) + " of 20 hedged calls answered");
+        check(pool.hedged_calls() > 0, std::to_string(pool.hedged_calls()) + " calls were hedged");
+        check(pool.hedge_wins() > 0, "the hedge won " + std::to_string(pool.hedge_wins()) + " times");
+        check(slowest_ms < 300, "the slowest call took " + std::to_string(slowest_ms) + "ms, the slow connection was beaten");
+    } catch (const std::exception& ex) {
+        check(false, std::string("test_hedged_call: ") + ex.what());
+    }
+
+    std::cout << "test_hedged_call finished!" << std::endl;
+}
+
+void test_shared_io_service(size_t n, bool is_ssl=true) {
+    std::cout << "test_shared_io_service start!" << std::endl;
+
+    // n clients share a few event loops instead of running n threads
+    boost::asio::io_service ios;
+    boost::asio::io_service::work work(ios);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < 4; ++i) {
+        threads.emplace_back([&ios] { ios.run(); });
+    }
+
+    auto callbacks = std::make_shared<std::atomic<size_t>>(0);
+    size_t issued = 0;
+    {
+        std::vector<std::shared_ptr<rpc_client>> clients;
+        for (size_t i = 0; i < n; ++i) {
+            auto client = std::make_shared<rpc_client>(ios);
+            if (!client_connect(*client, is_ssl, 9000, "127.0.0.1")) {
+                std::cout << "connect failed!" << std::endl;
+                break;
+            }
+            clients.push_back(client);
+        }
+
+        size_t answered = 0;
+        for (auto& client : clients) {
+            try {
+                if (client->call<std::string>("echo", "shared io_service") == "shared io_service") {
+                    answered++;
+                }
+            } catch (const std::exception & ex) {
+                std::cout << ex.what() << std::endl;
+            }
+        }
+        check(answered == clients.size(), std::to_string(answered) + " of " + std::to_string(clients.size()) + " clients answered");
+
+        // the clients are destroyed while the loop threads are busy with their responses
+        for (auto& client : clients) {
+            for (int i = 0; i < 100; ++i) {
+                client->async_call("echo", [callbacks](boost::system::error_code, string_view) {
+                    (*callbacks)++;
+                }, "in flight");
+                issued++;
+            }
+        }
+    }
+    check(*callbacks <= issued, std::to_string(*callbacks) + " of " + std::to_string(issued) + " callbacks ran before the clients were gone");
+
+    // the loops survived it
+    rpc_client client(ios);
+    bool ok = false;
+    if (client_connect(client, is_ssl, 9000, "127.0.0.1")) {
+        try {
+            ok = client.call<std::string>("echo", "after") == "after";
+        } catch (const std::exception&) {
+        }
+    }
+    check(ok, "a new client on the shared io_service works");
+
+    ios.stop();
+    for (auto& thd : threads) {
+        thd.join();
+    }
+
+    std::cout << "test_shared_io_service finished!" << std::endl;
+}
+
 template <typename T>
 void test_multi_client_performance(size_t n, T & func, bool is_ssl=true) {
     std::cout << "test_multi_client_performance start!" << std::endl;
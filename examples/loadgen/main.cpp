@@ -0,0 +1,361 @@
+#include <rest_rpc.hpp>
+
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <thread>
+
+using namespace rest_rpc;
+using namespace rest_rpc::rpc_service;
+
+// Load generator for an rpc_server, reports throughput and latency percentiles.
+//
+//   rpc_loadgen --mode=closed --concurrency=64 --methods=echo --payloads=64:9,65536:1
+//   rpc_loadgen --mode=open --rate=50000 --duration=30 --json=result.json
+//
+// closed: each response triggers the next request, concurrency requests are outstanding.
+// open: requests are sent at a fixed rate whatever the responses do; the latency of a request is
+// measured from when it was due, not when it was sent, so a stalled server or client isn't hidden
+// by the requests it delayed (coordinated omission).
+// Every method is called with one string argument of a payload size, like echo.
+
+namespace {
+    using clock_type = std::chrono::steady_clock;
+
+    struct weighted {
+        std::string value;
+        double weight;
+    };
+
+    struct options {
+        std::string host = "127.0.0.1";
+        unsigned short port = 9000;
+        std::string mode = "closed";
+        size_t connections = 4;
+        size_t threads = 2;       // event loops the connections are spread over
+        size_t concurrency = 64;  // closed: requests outstanding over all connections
+        double rate = 10000;      // open: requests per second over all connections
+        double duration = 10;     // seconds measured, after the warmup
+        double warmup = 2;
+        size_t timeout_ms = 5000;
+        std::vector<weighted> methods{ { "echo", 1 } };
+        std::vector<weighted> payloads{ { "64", 1 } };
+        std::string json;  // a path or "-" for stdout, text is printed otherwise
+    };
+
+    // "a:3,b:1", a weight defaults to 1
+    std::vector<weighted> parse_weighted(const std::string& text) {
+        std::vector<weighted> list;
+        std::stringstream ss(text);
+        std::string item;
+        while (std::getline(ss, item, ',')) {
+            if (item.empty()) {
+                continue;
+            }
+
+            auto colon = item.find(':');
+            if (colon == std::string::npos) {
+                list.push_back({ item, 1 });
+            }
+            else {
+                list.push_back({ item.substr(0, colon), std::atof(item.c_str() + colon + 1) });
+            }
+        }
+        return list;
+    }
+
+    bool parse_options(int argc, char* argv[], options& opts) {
+        for (int i = 1; i < argc; ++i) {
+            std::string arg = argv[i];
+            auto eq = arg.find('=');
+            if (arg.compare(0, 2, "--") != 0 || eq == std::string::npos) {
+                std::cout << "unknown argument " << arg << std::endl;
+                return false;
+            }
+
+            auto key = arg.substr(2, eq - 2);
+            auto value = arg.substr(eq + 1);
+            if (key == "host") opts.host = value;
+            else if (key == "port") opts.port = (unsigned short)std::atoi(value.c_str());
+            else if (key == "mode") opts.mode = value;
+            else if (key == "connections") opts.connections = (size_t)std::atol(value.c_str());
+            else if (key == "threads") opts.threads = (size_t)std::atol(value.c_str());
+            else if (key == "concurrency") opts.concurrency = (size_t)std::atol(value.c_str());
+            else if (key == "rate") opts.rate = std::atof(value.c_str());
+            else if (key == "duration") opts.duration = std::atof(value.c_str());
+            else if (key == "warmup") opts.warmup = std::atof(value.c_str());
+            else if (key == "timeout") opts.timeout_ms = (size_t)std::atol(value.c_str());
+            else if (key == "methods") opts.methods = parse_weighted(value);
+            else if (key == "payloads") opts.payloads = parse_weighted(value);
+            else if (key == "json") opts.json = value;
+            else {
+                std::cout << "unknown option " << key << std::endl;
+                return false;
+            }
+        }
+
+        if (opts.mode != "closed" && opts.mode != "open") {
+            std::cout << "mode is closed or open" << std::endl;
+            return false;
+        }
+        if (opts.connections == 0 || opts.threads == 0 || opts.concurrency == 0 || opts.rate <= 0 ||
+            opts.methods.empty() || opts.payloads.empty()) {
+            std::cout << "connections, threads, concurrency, rate, methods and payloads can't be empty" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    // a request of the mix, packed once
+    struct request_kind {
+        std::string method;
+        size_t payload;
+        std::string packed;
+    };
+
+    // written by the event loop of its client only, read once the loops stopped
+    struct load_connection {
+        std::unique_ptr<rpc_client> client;
+        boost::asio::io_service* ios;
+        std::minstd_rand rng;
+        std::discrete_distribution<size_t> pick;
+        latency_histogram latency;
+        uint64_t completed = 0;
+        uint64_t errors = 0;
+    };
+
+    class load_generator {
+    public:
+        explicit load_generator(const options& opts) : opts_(opts) {
+            std::vector<double> weights;
+            for (auto& method : opts_.methods) {
+                for (auto& payload : opts_.payloads) {
+                    size_t size = (size_t)std::atol(payload.value.c_str());
+                    auto buffer = msgpack_codec::pack_args(method.value, std::string(size, 'x'));
+                    kinds_.push_back({ method.value, size, std::string(buffer.data(), buffer.size()) });
+                    weights.push_back(method.weight * payload.weight);
+                }
+            }
+            pick_ = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+
+            for (size_t i = 0; i < opts_.threads; ++i) {
+                ios_.emplace_back(new boost::asio::io_service);
+                work_.emplace_back(new boost::asio::io_service::work(*ios_.back()));
+            }
+            for (size_t i = 0; i < opts_.threads; ++i) {
+                auto ios = ios_[i].get();
+                threads_.emplace_back([ios] { ios->run(); });
+            }
+        }
+
+        ~load_generator() {
+            for (auto& conn : connections_) {
+                conn->client.reset();
+            }
+            work_.clear();
+            for (auto& ios : ios_) {
+                ios->stop();
+            }
+            for (auto& thd : threads_) {
+                thd.join();
+            }
+        }
+
+        bool connect() {
+            for (size_t i = 0; i < opts_.connections; ++i) {
+                std::unique_ptr<load_connection> conn(new load_connection);
+                conn->ios = ios_[i % ios_.size()].get();
+                conn->client.reset(new rpc_client(*conn->ios));
+                conn->rng.seed((unsigned)i + 1);
+                conn->pick = pick_;
+                if (!conn->client->connect(opts_.host, opts_.port)) {
+                    std::cout << "connect to " << opts_.host << ":" << opts_.port << " failed" << std::endl;
+                    return false;
+                }
+                connections_.push_back(std::move(conn));
+            }
+            return true;
+        }
+
+        void run() {
+            begin_ = clock_type::now() + to_duration(opts_.warmup);
+            end_ = begin_ + to_duration(opts_.duration);
+            running_ = true;
+            if (opts_.mode == "closed") {
+                run_closed();
+            }
+            else {
+                run_open();
+            }
+            running_ = false;
+
+            // wait for the requests still in flight, they are not measured
+            auto deadline = clock_type::now() + std::chrono::milliseconds(opts_.timeout_ms + 1000);
+            while (in_flight_ > 0 && clock_type::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+            for (auto& ios : ios_) {
+                ios->stop();
+            }
+            for (auto& thd : threads_) {
+                thd.join();
+            }
+            threads_.clear();
+        }
+
+        void report() const {
+            latency_histogram latency;
+            uint64_t completed = 0;
+            uint64_t errors = 0;
+            for (auto& conn : connections_) {
+                auto& buckets = conn->latency.buckets();
+                for (size_t b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+                    if (buckets[b] != 0) {
+                        latency.add(b, buckets[b]);
+                    }
+                }
+                latency.add_sum((uint64_t)conn->latency.sum().count());
+                completed += conn->completed;
+                errors += conn->errors;
+            }
+
+            auto us = [&latency](double p) { return latency.percentile(p).count() / 1000.0; };
+            double mean = completed == 0 ? 0 : latency.sum().count() / 1000.0 / completed;
+            double throughput = completed / opts_.duration;
+            char text[1024];
+            if (opts_.json.empty()) {
+                snprintf(text, sizeof(text),
+                    "mode %s, %zu connections, %s %.0f, %.1fs measured\n"
+                    "requests %llu, errors %llu, throughput %.1f req/s\n"
+                    "latency us: mean %.1f, p50 %.1f, p90 %.1f, p99 %.1f, p999 %.1f, max %.1f\n",
+                    opts_.mode.c_str(), opts_.connections, opts_.mode == "closed" ? "concurrency" : "rate",
+                    opts_.mode == "closed" ? (double)opts_.concurrency : opts_.rate, opts_.duration,
+                    (unsigned long long)completed, (unsigned long long)errors, throughput,
+                    mean, us(0.5), us(0.9), us(0.99), us(0.999), us(1.0));
+                std::cout << text;
+                return;
+            }
+
+            snprintf(text, sizeof(text),
+                "{\"mode\":\"%s\",\"connections\":%zu,\"concurrency\":%zu,\"rate\":%.1f,\"duration_s\":%.3f,"
+                "\"requests\":%llu,\"errors\":%llu,\"throughput\":%.1f,"
+                "\"latency_us\":{\"mean\":%.1f,\"p50\":%.1f,\"p90\":%.1f,\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+                opts_.mode.c_str(), opts_.connections, opts_.concurrency, opts_.rate, opts_.duration,
+                (unsigned long long)completed, (unsigned long long)errors, throughput,
+                mean, us(0.5), us(0.9), us(0.99), us(0.999), us(1.0));
+            if (opts_.json == "-") {
+                std::cout << text;
+            }
+            else {
+                std::ofstream file(opts_.json);
+                file << text;
+            }
+        }
+
+    private:
+        static clock_type::duration to_duration(double seconds) {
+            return std::chrono::duration_cast<clock_type::duration>(std::chrono::duration<double>(seconds));
+        }
+
+        // due is when the request was meant to be sent, the latency is measured from it
+        void send(load_connection& conn, clock_type::time_point due) {
+            auto kind = &kinds_[conn.pick(conn.rng)];
+            buffer_type buffer(kind->packed.size());
+            buffer.write(kind->packed.data(), kind->packed.size());
+            in_flight_++;
+            auto* c = &conn;
+            conn.client->async_call_packed(kind->method, std::move(buffer),
+                [this, c, due](boost::system::error_code ec, string_view data) {
+                    record(*c, due, ec, data);
+                    in_flight_--;
+                    if (running_ && opts_.mode == "closed") {
+                        // not from the callback: a call failing at once (not connected, no room)
+                        // calls back inline, sending again from there would recurse without end
+                        c->ios->post([this, c] { send(*c, clock_type::now()); });
+                    }
+                }, opts_.timeout_ms);
+        }
+
+        void record(load_connection& conn, clock_type::time_point due, boost::system::error_code ec, string_view data) {
+            if (due < begin_ || due >= end_) {
+                return;
+            }
+
+            auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(clock_type::now() - due).count();
+            conn.latency.add(latency_histogram::bucket_of((uint64_t)ns), 1);
+            conn.latency.add_sum((uint64_t)ns);
+            conn.completed++;
+            bool failed = true;
+            if (!ec) {
+                try {
+                    failed = has_error(data);
+                }
+                catch (const std::exception&) {
+                }
+            }
+            if (failed) {
+                conn.errors++;
+            }
+        }
+
+        void run_closed() {
+            for (size_t i = 0; i < opts_.concurrency; ++i) {
+                auto* conn = connections_[i % connections_.size()].get();
+                conn->ios->post([this, conn] { send(*conn, clock_type::now()); });
+            }
+            std::this_thread::sleep_until(end_);
+        }
+
+        void run_open() {
+            auto start = clock_type::now();
+            std::chrono::duration<double> interval(1.0 / opts_.rate);
+            uint64_t sent = 0;
+            auto due = start;
+            while (due < end_) {
+                if (due > clock_type::now()) {
+                    std::this_thread::sleep_until(due);
+                }
+
+                // catch up with everything due by now, a late request keeps its due time
+                auto now = clock_type::now();
+                while (due <= now && due < end_) {
+                    send(*connections_[sent % connections_.size()], due);
+                    sent++;
+                    due = start + std::chrono::duration_cast<clock_type::duration>(interval * (double)sent);
+                }
+            }
+        }
+
+        options opts_;
+        std::vector<request_kind> kinds_;
+        std::discrete_distribution<size_t> pick_;
+        std::vector<std::unique_ptr<boost::asio::io_service>> ios_;
+        std::vector<std::unique_ptr<boost::asio::io_service::work>> work_;
+        std::vector<std::thread> threads_;
+        std::vector<std::unique_ptr<load_connection>> connections_;
+        clock_type::time_point begin_;
+        clock_type::time_point end_;
+        std::atomic<bool> running_ = { false };
+        std::atomic<size_t> in_flight_ = { 0 };
+    };
+}  // namespace
+
+int main(int argc, char* argv[]) {
+    options opts;
+    if (!parse_options(argc, argv, opts)) {
+        return 1;
+    }
+
+    load_generator generator(opts);
+    if (!generator.connect()) {
+        return 1;
+    }
+
+    generator.run();
+    generator.report();
+    return 0;
+}
@@ -4,6 +4,8 @@ using namespace rpc_service;
 
 #include <fstream>
 #include <chrono>
+#include <csignal>
+#include <map>
 
 #include "event.h"
 
@@ -103,6 +105,148 @@ std::string download(rpc_conn conn, const std::string& filename) {
     return content;
 }
 
+// same result as download, but the file goes to the socket with sendfile without being copied
+void download_zero_copy(rpc_conn conn, const std::string& filename) {
+#ifdef __RESTRPC_VERBOSE__
+    std::cout << "func: " << __FUNCTION__ << std::endl;
+#endif
+    g_event.increase();
+    auto conn_sp = conn.lock();
+    auto file = file_region::open(filename);
+    if (file) {
+        conn_sp->response_file(conn_sp->request_id(), file);
+    } else {
+        conn_sp->pack_and_response(conn_sp->request_id(), std::string());
+    }
+}
+
+// streaming version of upload, the file is written chunk by chunk with constant memory
+void upload_stream(rpc_conn conn, stream_ptr stream, const std::string& filename) {
+#ifdef __RESTRPC_VERBOSE__
+    std::cout << "func: " << __FUNCTION__ << std::endl;
+#endif
+    g_event.increase();
+    std::ofstream file(filename, std::ios::binary);
+    std::string chunk;
+    while (stream->read(chunk)) {
+        file.write(chunk.data(), chunk.size());
+    }
+}
+
+// streaming version of download
+void download_stream(rpc_conn conn, stream_ptr stream, const std::string& filename) {
+#ifdef __RESTRPC_VERBOSE__
+    std::cout << "func: " << __FUNCTION__ << std::endl;
+#endif
+    g_event.increase();
+    std::ifstream file(filename, std::ios::binary);
+    if (!file) {
+        stream->finish(result_code::FAIL, "no such file: " + filename);
+        return;
+    }
+
+    std::string chunk(STREAM_CHUNK_SIZE, '\0');
+    while (file) {
+        file.read(&chunk[0], chunk.size());
+        if (!stream->write(string_view(chunk.data(), (size_t)file.gcount()))) {
+            return;
+        }
+    }
+}
+
+std::atomic<size_t> g_ingested_logs{ 0 };
+
+// called oneway by the client, no response is sent
+void ingest_log(rpc_conn conn, const std::string& line) {
+    auto lines = ++g_ingested_logs;
+    if (lines % 10000 == 0) {
+        std::cout << lines << " log lines ingested" << std::endl;
+    }
+}
+
+size_t ingested_logs(rpc_conn conn) {
+    return g_ingested_logs;
+}
+
+std::atomic<int> g_slow_query_steps{ 0 };  // run by the last slow_query
+
+// does its work in steps and stops early once the caller's deadline passed
+std::string slow_query(rpc_conn conn, int steps) {
+    auto deadline = conn.lock()->deadline();
+    for (int i = 0; i < steps; i++) {
+        if (deadline <= std::chrono::steady_clock::now()) {
+            g_slow_query_steps = i;
+            throw std::runtime_error("deadline exceeded after " + std::to_string(i) + " steps");
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    g_slow_query_steps = steps;
+    return "done";
+}
+
+int slow_query_steps(rpc_conn conn) {
+    return g_slow_query_steps;
+}
+
+std::mutex g_delays_mtx;
+std::map<int64_t, int> g_connection_delays;  // milliseconds delayed_echo sleeps per connection
+
+// makes delayed_echo slow on the calling connection, e.g. to have a hedged call beat it
+void set_connection_delay(rpc_conn conn, int ms) {
+    std::lock_guard<std::mutex> lock(g_delays_mtx);
+    g_connection_delays[conn.lock()->conn_id()] = ms;
+}
+
+std::string delayed_echo(rpc_conn conn, const std::string& src) {
+    auto conn_sp = conn.lock();
+    int ms = 0;
+    {
+        std::lock_guard<std::mutex> lock(g_delays_mtx);
+        auto it = g_connection_delays.find(conn_sp->conn_id());
+        if (it != g_connection_delays.end()) {
+            ms = it->second;
+        }
+    }
+    // a hedged call cancels the loser, give its worker back early
+    for (int i = 0; i < ms && !conn_sp->cancelled(); i += 10) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return src;
+}
+
+// keeps its request body in use for a while, enough of them fill the receive memory limit
+size_t hold_body(rpc_conn conn, const std::string& payload, int ms) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+    return payload.size();
+}
+
+std::atomic<size_t> g_cancelled_queries{ 0 };
+
+// checks between its steps whether the client cancelled the call
+std::string cancellable_query(rpc_conn conn, int steps) {
+    auto conn_sp = conn.lock();
+    for (int i = 0; i < steps; i++) {
+        if (conn_sp->cancelled()) {
+            g_cancelled_queries++;
+            std::cout << "cancellable_query cancelled after " << i << " steps" << std::endl;
+            return "";  // the response is dropped anyway
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    return "done";
+}
+
+// trace ids of the server spans recorded since the last collect
+std::vector<uint64_t> server_trace_ids(rpc_conn conn) {
+    std::vector<uint64_t> ids;
+    for (auto& span : get_tracer().collect()) {
+        if (span.kind == span_kind::server) {
+            ids.push_back(span.trace_id);
+        }
+    }
+    return ids;
+}
+
 double get_latency(rpc_conn conn, const std::chrono::system_clock::time_point& start) {
 #ifdef __RESTRPC_VERBOSE__
     std::cout << "func: " << __FUNCTION__ << std::endl;
@@ -125,6 +269,13 @@ void start_server(bool with_ssl=true) {
         server = new rpc_server(9000, std::thread::hardware_concurrency());
     }
 
+    // run handlers on worker threads, so pipelined requests of one connection run concurrently
+    server->set_worker_threads(std::thread::hardware_concurrency());
+    // responses completing within 100us of each other go out in one write
+    server->set_response_coalescing(100, 16 * 1024);
+    // offered codecs are accepted when built with ENABLE_LZ4 or ENABLE_ZSTD
+    server->enable_compression();
+
     dummy d;
     person p = { 1, "tom", 20 };
 
@@ -135,7 +286,41 @@ void start_server(bool with_ssl=true) {
     server->register_handler("get_person_name", get_person_name);
     server->register_handler("upload", upload);
     server->register_handler("download", download);
+    server->register_handler<Async>("download_zero_copy", download_zero_copy);
     server->register_handler("get_latency", get_latency);
+    server->register_handler("server_trace_ids", server_trace_ids);
+    server->register_handler("ingest_log", ingest_log);
+    server->register_handler("ingested_logs", ingested_logs);
+    server->register_handler("slow_query", slow_query);
+    server->register_handler("slow_query_steps", slow_query_steps);
+    // more concurrent slow_query calls are rejected with result_code::OVERLOADED
+    server->set_method_limit("slow_query", 4);
+    // slow_query calls of 5 steps or more are logged with their arguments
+    server->set_slow_request_threshold("slow_query", std::chrono::milliseconds(50));
+    server->register_handler("cancellable_query", cancellable_query);
+    server->register_handler("cancelled_queries", [](rpc_conn conn) {
+        return (size_t)g_cancelled_queries;
+    });
+    // large request bodies in use by all connections together, room for 4 frames of the max size;
+    // a request over it is answered with result_code::OVERLOADED
+    server->set_receive_memory_limit(4 * MAX_BUF_LEN);
+    server->register_handler("hold_body", hold_body);
+    server->register_handler("set_connection_delay", set_connection_delay);
+    server->register_handler("delayed_echo", delayed_echo);
+    // what get_buffer_footprints reports for the calling connection
+    server->register_handler("buffer_footprint", [&server](rpc_conn conn) {
+        auto footprints = server->get_buffer_footprints();
+        auto it = footprints.find(conn.lock()->conn_id());
+        return it == footprints.end() ? (size_t)0 : it->second;
+    });
+    // curl http://127.0.0.1:9100/metrics
+    server->enable_metrics_http(9100);
+#ifndef _WIN32
+    // kill -USR2 <pid> writes the recent requests of every thread, open it in chrome://tracing
+    server->enable_flight_recorder_dump(SIGUSR2, "flight_recorder.json");
+#endif
+    server->register_stream_handler("upload_stream", upload_stream);
+    server->register_stream_handler("download_stream", download_stream);
     server->register_handler("publish", [&server](rpc_conn conn, std::string key, std::string token, std::string val) {
         server->publish(std::move(key), std::move(val));
     });
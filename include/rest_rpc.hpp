@@ -1,2 +1,3 @@
 #include "rest_rpc/rpc_server.h"
-#include "rest_rpc/rpc_client.hpp"
\ No newline at end of file
+#include "rest_rpc/rpc_client.hpp"
+#include "rest_rpc/rpc_client_pool.hpp"
\ No newline at end of file
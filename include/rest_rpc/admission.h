@@ -0,0 +1,190 @@
+#ifndef REST_RPC_ADMISSION_H_
+#define REST_RPC_ADMISSION_H_
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "use_asio.hpp"
+#include "frame.h"
+
+namespace rest_rpc {
+    namespace rpc_service {
+        /**
+         * Limits on the requests admitted and not answered yet, server wide, per connection and per
+         * method. A request over a limit is rejected when it is read, before it is decoded or queued
+         * for a worker, so overload is answered fast instead of piling up as queueing delay.
+         *
+         * The adaptive limit lowers the server wide limit by a tenth when a request took more than
+         * tolerance times the lowest recent latency, and raises it by one per limit requests answered
+         * in time while it is in use.
+         */
+        class admission_control : private asio::noncopyable {
+        public:
+            // 0 means unlimited for all the limits
+            void set_max_requests(size_t n) {
+                std::unique_lock<std::mutex> lock(mtx_);
+                max_requests_ = n;
+                update_enabled();
+            }
+
+            void set_max_connection_requests(size_t n) {
+                std::unique_lock<std::mutex> lock(mtx_);
+                max_connection_requests_ = n;
+                update_enabled();
+            }
+
+            // applies to requests carrying a method id, which clients send with v2 headers
+            void set_method_limit(const std::string& name, size_t n) {
+                std::unique_lock<std::mutex> lock(mtx_);
+                auto id = method_id(name.data(), name.size());
+                if (n == 0) {
+                    methods_.erase(id);
+                }
+                else {
+                    methods_[id].max = n;
+                }
+                update_enabled();
+            }
+
+            void enable_adaptive_limit(size_t min_limit, size_t max_limit, double tolerance = 2.0) {
+                std::unique_lock<std::mutex> lock(mtx_);
+                adaptive_ = max_limit != 0;
+                min_limit_ = (std::max)(min_limit, (size_t)1);
+                max_limit_ = (std::max)(max_limit, min_limit_);
+                tolerance_ = tolerance;
+                limit_ = (double)max_limit_;
+                update_enabled();
+            }
+
+            // a request of a connection which has conn_requests admitted ones, false to reject it
+            bool try_acquire(uint32_t method, size_t conn_requests) {
+                if (!enabled_) {
+                    requests_++;
+                    return true;
+                }
+
+                std::unique_lock<std::mutex> lock(mtx_);
+                size_t limit = current_limit();
+                if ((limit != 0 && requests_ >= limit) ||
+                    (max_connection_requests_ != 0 && conn_requests >= max_connection_requests_)) {
+                    rejected_++;
+                    return false;
+                }
+
+                auto it = methods_.find(method);
+                if (it != methods_.end()) {
+                    if (it->second.requests >= it->second.max) {
+                        rejected_++;
+                        return false;
+                    }
+                    it->second.requests++;
+                }
+
+                requests_++;
+                return true;
+            }
+
+            // an admitted request was answered or dropped, only answered ones feed the adaptive limit
+            void release(uint32_t method, std::chrono::steady_clock::duration latency, bool answered) {
+                if (!enabled_) {
+                    requests_--;
+                    return;
+                }
+
+                std::unique_lock<std::mutex> lock(mtx_);
+                size_t requests = requests_--;
+                auto it = methods_.find(method);
+                if (it != methods_.end() && it->second.requests > 0) {
+                    it->second.requests--;
+                }
+
+                if (adaptive_ && answered) {
+                    adapt(latency, requests);
+                }
+            }
+
+            // requests admitted and not answered yet
+            size_t requests() const { return requests_; }
+
+            uint64_t rejected() const { return rejected_; }
+
+            // the server wide limit now, 0 if unlimited
+            size_t limit() const {
+                std::unique_lock<std::mutex> lock(mtx_);
+                return current_limit();
+            }
+
+        private:
+            struct method_limit {
+                size_t max = 0;
+                size_t requests = 0;
+            };
+
+            size_t current_limit() const {
+                if (!adaptive_) {
+                    return max_requests_;
+                }
+
+                size_t limit = (size_t)limit_;
+                return max_requests_ == 0 ? limit : (std::min)(limit, max_requests_);
+            }
+
+            void update_enabled() {
+                enabled_ = max_requests_ != 0 || max_connection_requests_ != 0 || !methods_.empty() || adaptive_;
+            }
+
+            void adapt(std::chrono::steady_clock::duration latency, size_t requests) {
+                // the lowest latency of the last window approximates the latency without queueing
+                if (window_min_ == std::chrono::steady_clock::duration::zero() || latency < window_min_) {
+                    window_min_ = latency;
+                }
+                if (min_latency_ == std::chrono::steady_clock::duration::zero() || window_min_ < min_latency_) {
+                    min_latency_ = window_min_;
+                }
+                if (++samples_ % LATENCY_WINDOW == 0) {
+                    min_latency_ = window_min_;
+                    window_min_ = std::chrono::steady_clock::duration::zero();
+                }
+
+                since_decrease_++;
+                if (latency > min_latency_ * tolerance_) {
+                    // at most once per limit requests, the ones sent before the decrease still complete late
+                    if (since_decrease_ >= (size_t)limit_) {
+                        limit_ = (std::max)(limit_ * 0.9, (double)min_limit_);
+                        since_decrease_ = 0;
+                    }
+                    return;
+                }
+
+                // only grow while the limit is what holds requests back
+                if (requests * 2 >= (size_t)limit_) {
+                    limit_ = (std::min)(limit_ + 1.0 / limit_, (double)max_limit_);
+                }
+            }
+
+            static const size_t LATENCY_WINDOW = 1000;
+
+            mutable std::mutex mtx_;
+            std::atomic<bool> enabled_ = { false };
+            std::atomic<size_t> requests_ = { 0 };
+            std::atomic<uint64_t> rejected_ = { 0 };
+            size_t max_requests_ = 0;
+            size_t max_connection_requests_ = 0;
+            std::unordered_map<uint32_t, method_limit> methods_;
+
+            bool adaptive_ = false;
+            size_t min_limit_ = 1;
+            size_t max_limit_ = 0;
+            double tolerance_ = 2.0;
+            double limit_ = 0;
+            std::chrono::steady_clock::duration min_latency_{ 0 };
+            std::chrono::steady_clock::duration window_min_{ 0 };
+            uint64_t samples_ = 0;
+            size_t since_decrease_ = 0;
+        };
+    }  // namespace rpc_service
+}  // namespace rest_rpc
+
+#endif  // REST_RPC_ADMISSION_H_
@@ -0,0 +1,97 @@
+#ifndef REST_RPC_BUFFER_POOL_H_
+#define REST_RPC_BUFFER_POOL_H_
+
+#include <atomic>
+#include <mutex>
+#include <vector>
+#include "use_asio.hpp"
+#include "const_vars.h"
+
+namespace rest_rpc {
+    namespace rpc_service {
+        /**
+         * Receive buffers bigger than MAX_RETAINED_BUF_LEN are borrowed from this pool for one
+         * request and given back afterwards, so a single large call doesn't pin its memory for the
+         * lifetime of the connection. It also accounts them against a server wide limit.
+         */
+        class buffer_pool : private asio::noncopyable {
+        public:
+            explicit buffer_pool(size_t max_pooled_bytes = 64 * 1024 * 1024, size_t max_receive_bytes = 0)
+                : max_pooled_bytes_(max_pooled_bytes), max_receive_bytes_(max_receive_bytes) {
+            }
+
+            // 0 means unlimited
+            void set_max_receive_bytes(size_t bytes) { max_receive_bytes_ = bytes; }
+
+            void set_max_pooled_bytes(size_t bytes) {
+                std::unique_lock<std::mutex> lock(mtx_);
+                max_pooled_bytes_ = bytes;
+                while (pooled_bytes_ > max_pooled_bytes_) {
+                    pooled_bytes_ -= buffers_.back().capacity();
+                    buffers_.pop_back();
+                }
+            }
+
+            // bytes of large receive buffers in use
+            size_t receive_bytes() const { return receive_bytes_; }
+
+            // acquire calls refused by the receive memory limit
+            uint64_t rejected() const { return rejected_; }
+
+            size_t pooled_bytes() const {
+                std::unique_lock<std::mutex> lock(mtx_);
+                return pooled_bytes_;
+            }
+
+            // a buffer of size bytes, false if it would exceed the receive memory limit
+            bool acquire(size_t size, std::vector<char>& buffer) {
+                size_t used = receive_bytes_.fetch_add(size);
+                if (max_receive_bytes_ != 0 && used + size > max_receive_bytes_) {
+                    receive_bytes_ -= size;
+                    rejected_++;
+                    return false;
+                }
+
+                {
+                    std::unique_lock<std::mutex> lock(mtx_);
+                    for (auto it = buffers_.begin(); it != buffers_.end(); ++it) {
+                        if (it->capacity() >= size) {
+                            pooled_bytes_ -= it->capacity();
+                            buffer.swap(*it);
+                            buffers_.erase(it);
+                            break;
+                        }
+                    }
+                }
+
+                buffer.resize(size);
+                return true;
+            }
+
+            // give back a buffer got from acquire(size)
+            void release(size_t size, std::vector<char> buffer) {
+                receive_bytes_ -= size;
+
+                std::unique_lock<std::mutex> lock(mtx_);
+                if (pooled_bytes_ + buffer.capacity() > max_pooled_bytes_) {
+                    return;
+                }
+
+                pooled_bytes_ += buffer.capacity();
+                buffers_.push_back(std::move(buffer));
+            }
+
+        private:
+            size_t max_pooled_bytes_;
+            std::atomic<size_t> max_receive_bytes_;
+            std::atomic<size_t> receive_bytes_ = { 0 };
+            std::atomic<uint64_t> rejected_ = { 0 };
+
+            mutable std::mutex mtx_;
+            std::vector<std::vector<char>> buffers_;
+            size_t pooled_bytes_ = 0;
+        };
+    }  // namespace rpc_service
+}  // namespace rest_rpc
+
+#endif  // REST_RPC_BUFFER_POOL_H_
@@ -16,15 +16,18 @@ using string_view = boost::string_view;
 #include "codec.h"
 
 namespace rest_rpc {
+    inline int get_result_code(string_view result) {
+        rpc_service::msgpack_codec codec;
+        auto tp = codec.unpack<std::tuple<int>>(result.data(), result.size());
+        return std::get<0>(tp);
+    }
+
     inline bool has_error(string_view result) {
         if (result.empty()) {
             return true;
         }            
 
-        rpc_service::msgpack_codec codec;
-        auto tp = codec.unpack<std::tuple<int>>(result.data(), result.size());
-
-        return std::get<0>(tp) != 0;
+        return get_result_code(result) != 0;
     }
 
     template<typename T>
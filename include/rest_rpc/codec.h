@@ -1,6 +1,7 @@
 #ifndef REST_RPC_CODEC_H_
 #define REST_RPC_CODEC_H_
 
+#include <sstream>
 #include <msgpack.hpp>
 
 namespace rest_rpc {
@@ -25,6 +26,16 @@ namespace rpc_service {
     return std::string(buffer.data(), buffer.size());
   }
 
+  // what pack_args_str(result_code::OK, str) puts before the bytes of a str of that size
+  static std::string pack_str_result_head(uint32_t size) {
+    buffer_type buffer(16);
+    msgpack::packer<buffer_type> packer(buffer);
+    packer.pack_array(2);
+    packer.pack(0);
+    packer.pack_str(size);
+    return std::string(buffer.data(), buffer.size());
+  }
+
   template<typename T>
   buffer_type pack(T&& t) const {
     buffer_type buffer;
@@ -32,6 +43,23 @@ namespace rpc_service {
     return buffer;
   }
 
+  // a readable form of a packed value for logs, cut at max_length bytes
+  static std::string to_text(char const* data, size_t length, size_t max_length) {
+    std::ostringstream os;
+    try {
+      msgpack::unpacked msg;
+      msgpack::unpack(msg, data, length);
+      os << msg.get();
+    } catch (...) { return "(invalid msgpack)"; }
+
+    auto text = os.str();
+    if (text.size() > max_length) {
+      text.resize(max_length);
+      text += "...";
+    }
+    return text;
+  }
+
   template<typename T>
   T unpack(char const* data, size_t length) {
     try {
@@ -0,0 +1,115 @@
+#ifndef REST_RPC_COMPRESS_H_
+#define REST_RPC_COMPRESS_H_
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <vector>
+#ifdef REST_RPC_ENABLE_LZ4
+#include <lz4.h>
+#endif
+#ifdef REST_RPC_ENABLE_ZSTD
+#include <zstd.h>
+#endif
+#include "const_vars.h"
+
+namespace rest_rpc {
+    // codecs of this build, the client offers them in this order
+    inline std::vector<int> supported_compressions() {
+        std::vector<int> types;
+#ifdef REST_RPC_ENABLE_ZSTD
+        types.push_back((int)compress_type::zstd);
+#endif
+#ifdef REST_RPC_ENABLE_LZ4
+        types.push_back((int)compress_type::lz4);
+#endif
+        return types;
+    }
+
+    inline bool is_compression_supported(compress_type type) {
+        for (auto t : supported_compressions()) {
+            if (t == (int)type) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * A compressed payload is the uint32 size of the original bytes followed by the codec's output.
+     * Returns false if the codec isn't built in or the output isn't smaller, send it as is then.
+     */
+    inline bool compress(compress_type type, const char* data, size_t size, std::string& out) {
+        const size_t prefix = sizeof(uint32_t);
+        uint32_t original = (uint32_t)size;
+        size_t compressed = 0;
+        switch (type) {
+#ifdef REST_RPC_ENABLE_LZ4
+        case compress_type::lz4: {
+            out.resize(prefix + LZ4_compressBound((int)size));
+            int n = LZ4_compress_default(data, &out[prefix], (int)size, (int)(out.size() - prefix));
+            if (n <= 0) {
+                return false;
+            }
+            compressed = (size_t)n;
+            break;
+        }
+#endif
+#ifdef REST_RPC_ENABLE_ZSTD
+        case compress_type::zstd: {
+            out.resize(prefix + ZSTD_compressBound(size));
+            size_t n = ZSTD_compress(&out[prefix], out.size() - prefix, data, size, 1);
+            if (ZSTD_isError(n)) {
+                return false;
+            }
+            compressed = n;
+            break;
+        }
+#endif
+        default:
+            return false;
+        }
+
+        if (prefix + compressed >= size) {
+            return false;
+        }
+
+        memcpy(&out[0], &original, prefix);
+        out.resize(prefix + compressed);
+        return true;
+    }
+
+    // size of the original bytes of a compressed payload, 0 if it is malformed
+    inline size_t original_size(const char* data, size_t size) {
+        uint32_t original = 0;
+        if (size > sizeof(uint32_t)) {
+            memcpy(&original, data, sizeof(uint32_t));
+        }
+        return original;
+    }
+
+    // out must hold original_size(data, size) bytes
+    inline bool decompress(compress_type type, const char* data, size_t size, char* out, size_t out_size) {
+        const size_t prefix = sizeof(uint32_t);
+        if (size <= prefix) {
+            return false;
+        }
+
+        switch (type) {
+#ifdef REST_RPC_ENABLE_LZ4
+        case compress_type::lz4:
+            return LZ4_decompress_safe(data + prefix, out, (int)(size - prefix), (int)out_size) == (int)out_size;
+#endif
+#ifdef REST_RPC_ENABLE_ZSTD
+        case compress_type::zstd: {
+            size_t n = ZSTD_decompress(out, out_size, data + prefix, size - prefix);
+            return !ZSTD_isError(n) && n == out_size;
+        }
+#endif
+        default:
+            return false;
+        }
+    }
+}  // namespace rest_rpc
+
+#endif  // REST_RPC_COMPRESS_H_
@@ -5,8 +5,18 @@
 #include <memory>
 #include <array>
 #include <deque>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
 #include "use_asio.hpp"
 #include "const_vars.h"
+#include "file_region.h"
+#include "buffer_pool.h"
+#include "admission.h"
+#include "compress.h"
+#include "frame.h"
+#include "trace.h"
+#include "flight_recorder.h"
 #include "router.h"
 #include "cplusplus_14.h"
 
@@ -19,19 +29,43 @@ namespace rest_rpc {
             std::string key_file;
         };
 
+        // how responses were coalesced into socket writes
+        struct write_stats {
+            uint64_t writes = 0;
+            uint64_t messages = 0;
+            uint64_t bytes = 0;
+            uint64_t max_batch = 0;
+            uint64_t read_pauses = 0;  // times reading stopped because responses piled up
+
+            write_stats& operator+=(const write_stats& other) {
+                writes += other.writes;
+                messages += other.messages;
+                bytes += other.bytes;
+                max_batch = (std::max)(max_batch, other.max_batch);
+                read_pauses += other.read_pauses;
+                return *this;
+            }
+        };
+
         class connection : public std::enable_shared_from_this<connection>, private asio::noncopyable {
         public:
-            connection(boost::asio::io_service& io_service, std::size_t timeout_seconds, router& router)
-                : socket_(io_service),
+            connection(boost::asio::io_service& io_service, std::size_t timeout_seconds, router& router, buffer_pool& buffers,
+                admission_control& admission)
+                : io_service_(io_service),
+                socket_(io_service),
                 body_(INIT_BUF_SIZE),
                 timer_(io_service),
+                flush_timer_(io_service),
                 timeout_seconds_(timeout_seconds),
                 has_closed_(false),
-                router_(router){
+                router_(router),
+                buffers_(buffers),
+                admission_(admission) {
             }
 
             ~connection() { 
                 close(); 
+                release_body();
             }
 
             void start() { 
@@ -46,21 +80,142 @@ namespace rest_rpc {
             tcp::socket& socket() { return socket_; }
 
             bool has_closed() const { return has_closed_; }
+
+            // id of the request being dispatched on the calling thread, requests of one
+            // connection may run concurrently on the worker pool so it can't be a member.
             uint64_t request_id() const {
-                return req_id_;
+                return current_frame().req_id;
+            }
+
+            // the request being dispatched is a oneway call, its result is dropped
+            bool is_oneway() const {
+                return current_frame().req_type == request_type::oneway;
+            }
+
+            // when the client stops waiting for the request being dispatched, time_point::max() if it
+            // sent no deadline. Async handlers should keep a copy, it is only set during the dispatch.
+            std::chrono::steady_clock::time_point deadline() const {
+                auto& header = current_frame();
+                return (header.flags & FLAG_DEADLINE) ? header.deadline : std::chrono::steady_clock::time_point::max();
+            }
+
+            bool deadline_exceeded() const {
+                return deadline() <= std::chrono::steady_clock::now();
+            }
+
+            // the client cancelled the request being dispatched, long running handlers may stop early
+            bool cancelled() {
+                return is_cancelled(request_id());
+            }
+
+            // for async handlers which kept the request id, their response is dropped once cancelled
+            bool is_cancelled(uint64_t req_id) {
+                std::unique_lock<std::mutex> lock(pending_mtx_);
+                auto it = pending_.find(req_id);
+                return it != pending_.end() && it->second.cancelled;
+            }
+
+            // forget an answered or dropped request, returns false if the client cancelled it
+            bool finish_request(uint64_t req_id) {
+                pending_request request;
+                {
+                    std::unique_lock<std::mutex> lock(pending_mtx_);
+                    auto it = pending_.find(req_id);
+                    if (it == pending_.end()) {
+                        return true;
+                    }
+
+                    request = it->second;
+                    pending_.erase(it);
+                }
+
+                end_request(request.method_id, std::chrono::steady_clock::now() - request.start, !request.cancelled);
+                return !request.cancelled;
+            }
+
+            // when the request being dispatched was read, the time since is spent queued or running
+            std::chrono::steady_clock::time_point received_time() const {
+                return current_frame().received;
+            }
+
+            // method id sent by the client in a v2 header, 0 if none
+            uint32_t method_id() const {
+                return current_frame().method_id;
+            }
+
+            // header of the request being dispatched on the calling thread
+            const frame_header& frame() const {
+                return current_frame();
             }
 
             void response(uint64_t req_id, std::string data, request_type req_type = request_type::req_res) {
+                if (req_id == 0 && req_type == request_type::req_res) {
+                    return;  // a oneway call, e.g. answered by an async handler
+                }
+
+                if (req_type == request_type::req_res && !finish_request(req_id)) {
+                    return;
+                }
+
                 auto len = data.size();
-                assert(len < MAX_BUF_LEN);
+                if (len >= max_frame_size_) {
+                    if (req_type != request_type::req_res) {
+                        print("frame more than max frame size dropped");
+                        return;
+                    }
 
-                std::unique_lock<std::mutex> lock(write_mtx_);
-                write_queue_.emplace_back(message_type{ req_id, req_type, std::make_shared<std::string>(std::move(data)) });
-                if (write_queue_.size() > 1) {
+                    data = msgpack_codec::pack_args_str(result_code::FAIL, out_of_range_message());
+                    len = data.size();
+                }
+
+                uint8_t flags = 0;
+                if (req_type >= request_type::stream_open && req_type <= request_type::stream_ack) {
+                    flags |= FLAG_STREAMING;
+                }
+
+                auto type = compression_.load();
+                if (req_type == request_type::req_res && type != compress_type::none && len >= compress_threshold_) {
+                    std::string packed;
+                    if (compress(type, data.data(), len, packed)) {
+                        data.swap(packed);
+                        len = data.size();
+                        flags |= FLAG_COMPRESSED;
+                    }
+                }
+
+                message_type msg{ req_id, req_type, std::make_shared<std::string>(std::move(data)), nullptr, flags };
+                if (req_type == request_type::req_res) {
+                    // the frame is only the request's while a sync handler answers, req_ids
+                    // are unique per connection so a handler answering another one doesn't match
+                    auto& header = current_frame();
+                    if (current_connection() == this && header.req_id == req_id) {
+                        msg.method_id = header.method_id;
+                        if (header.trace_id != 0) {
+                            msg.trace_id = header.trace_id;
+                            msg.span_id = header.span_id;
+                            msg.queued = std::chrono::steady_clock::now();
+                        }
+                    }
+                    get_flight_recorder().record(flight_phase::response_queued, conn_id_, req_id, msg.method_id, len);
+                }
+                enqueue(std::move(msg), len);
+            }
+
+            // answer req_id with the bytes of the file region as a string result, e.g. from an async
+            // download handler; they are sent with sendfile after the header, without any copy.
+            void response_file(uint64_t req_id, std::shared_ptr<file_region> file) {
+                if (req_id == 0 || !finish_request(req_id)) {
+                    return;
+                }
+
+                auto head = msgpack_codec::pack_str_result_head((uint32_t)file->length);
+                auto len = head.size() + file->length;
+                if (len >= max_frame_size_) {
+                    response(req_id, msgpack_codec::pack_args_str(result_code::FAIL, out_of_range_message()));
                     return;
                 }
 
-                write();
+                enqueue(message_type{ req_id, request_type::req_res, std::make_shared<std::string>(std::move(head)), std::move(file) }, len);
             }
 
             template<typename T>
@@ -69,6 +224,52 @@ namespace rest_rpc {
                 response(req_id, std::move(result));
             }
 
+            // hold responses up to delay or max_bytes and send them in one write, trading a bounded
+            // latency for fewer syscalls and packets. Nagle is disabled as batching happens here.
+            void set_response_coalescing(std::chrono::microseconds delay, size_t max_bytes) {
+                std::unique_lock<std::mutex> lock(write_mtx_);
+                coalesce_delay_ = delay;
+                coalesce_bytes_ = max_bytes;
+                if (delay.count() > 0) {
+                    boost::system::error_code ignored_ec;
+                    socket_.set_option(tcp::no_delay(true), ignored_ec);
+                }
+            }
+
+            write_stats get_write_stats() {
+                std::unique_lock<std::mutex> lock(write_mtx_);
+                return write_stats_;
+            }
+
+            // stop reading requests while more than high_water bytes of responses wait to be written,
+            // until they are below low_water again. 0 disables it.
+            void set_read_backpressure(size_t high_water, size_t low_water) {
+                std::unique_lock<std::mutex> lock(write_mtx_);
+                high_water_ = high_water;
+                low_water_ = (std::min)(low_water, high_water);
+            }
+
+            // frames of this size or more are neither read nor written, it only shrinks when
+            // a client announces a smaller limit.
+            void set_max_frame_size(size_t size) { max_frame_size_ = (std::min)(size, MAX_FRAME_LIMIT); }
+
+            size_t max_frame_size() const { return max_frame_size_; }
+
+            // compress results of at least threshold bytes if the client offers a codec, 0 disables
+            void set_compression_threshold(size_t threshold) { compress_threshold_ = threshold; }
+
+            compress_type compression() const { return compression_; }
+
+            std::string out_of_range_message() const {
+                return "the response result is out of range: more than " + std::to_string(max_frame_size_.load()) + " bytes";
+            }
+
+            // bytes held by the receive buffer and the responses waiting to be written
+            size_t buffer_footprint() {
+                std::unique_lock<std::mutex> lock(write_mtx_);
+                return body_capacity_.load() + queued_bytes_;
+            }
+
             void set_conn_id(int64_t id) { conn_id_ = id; }
 
             int64_t conn_id() const { return conn_id_; }
@@ -85,6 +286,19 @@ namespace rest_rpc {
                 return socket_.remote_endpoint().address().to_string();
             }
             
+            // wake up the stream handlers of the connection with an error, it happens when it closes
+            void abort_streams() {
+                std::unordered_map<std::uint64_t, stream_ptr> streams;
+                {
+                    std::unique_lock<std::mutex> lock(streams_mtx_);
+                    streams.swap(streams_);
+                }
+
+                for (auto& stream : streams) {
+                    stream.second->abort("connection closed");
+                }
+            }
+
             void publish(const std::string& key, const std::string& data) {
                 auto result = msgpack_codec::pack_args_str(result_code::OK, key, data);
                 response(0, std::move(result), request_type::sub_pub);
@@ -123,47 +337,116 @@ namespace rest_rpc {
             }
 
         private:
+            void enqueue(message_type msg, size_t len) {
+                std::unique_lock<std::mutex> lock(write_mtx_);
+                write_queue_.emplace_back(std::move(msg));
+                queued_bytes_ += len;
+                if (writing_) {
+                    // sent together with the others queued when the current write completes
+                    return;
+                }
+
+                auto self = this->shared_from_this();
+                if (coalesce_delay_.count() > 0 && queued_bytes_ < coalesce_bytes_) {
+                    if (!flush_pending_) {
+                        flush_pending_ = true;
+                        io_service_.dispatch([this, self] { start_flush_timer(); });
+                    }
+                    return;
+                }
+
+                writing_ = true;
+                flush_pending_ = false;
+                lock.unlock();
+
+                // responses may come from worker threads, start writing on the io thread
+                io_service_.dispatch([this, self] {
+                    std::unique_lock<std::mutex> lock(write_mtx_);
+                    write();
+                });
+            }
+
             void read_head() {
+                {
+                    std::unique_lock<std::mutex> lock(write_mtx_);
+                    if (high_water_ != 0 && queued_bytes_ + sending_bytes_ > high_water_) {
+                        // the client doesn't read its responses, write_next resumes reading
+                        read_paused_ = true;
+                        write_stats_.read_pauses++;
+                        return;
+                    }
+                }
+
                 reset_timer();
                 auto self(this->shared_from_this());
-                async_read_head([this, self](boost::system::error_code ec, std::size_t length) {
+                async_read_head(read_v2_ ? HEAD_LEN_V2 : HEAD_LEN, [this, self](boost::system::error_code ec, std::size_t length) {
                     if (!socket_.is_open()) {
                         //LOG(INFO) << "socket already closed";
                         return;
                     }
 
-                    if (!ec) {
-                        //const uint32_t body_len = *((int*)(head_));
-                        //req_id_ = *((std::uint64_t*)(head_ + sizeof(int32_t)));
-                        rpc_header* header = (rpc_header*)(head_);
-                        req_id_ = header->req_id;
-                        const uint32_t body_len = header->body_len;
-                        req_type_ = header->req_type;
-                        if (body_len > 0 && body_len < MAX_BUF_LEN) {
-                            if (body_.size() < body_len) { body_.resize(body_len); }
-                            read_body(body_len);
-                            return;
-                        }
+                    if (ec) {
+                        print(ec);
+                        close();
+                        return;
+                    }
 
-                        if (body_len == 0) {  // nobody, just head, maybe as heartbeat.
-                            cancel_timer();
-                            read_head();
-                        }
-                        else {
-                            print("invalid body len");
+                    if (read_v2_ || !is_v2_head(head_)) {
+                        on_head();
+                        return;
+                    }
+
+                    // the client switched to v2 headers, they are all v2 from now on
+                    read_v2_ = true;
+                    async_read_head(HEAD_LEN_V2 - HEAD_LEN, [this, self](boost::system::error_code ec, std::size_t length) {
+                        if (ec) {
+                            print(ec);
                             close();
+                            return;
                         }
+
+                        on_head();
+                    }, HEAD_LEN);
+                });
+            }
+
+            void on_head() {
+                auto header = decode_head(head_, read_v2_);
+                if ((header.flags & FLAG_TRACE) || get_tracer().enabled()) {
+                    header.head_received = std::chrono::steady_clock::now();
+                }
+                const uint32_t body_len = header.body_len;
+                if (body_len > 0 && body_len < max_frame_size_) {
+                    auto size = body_len + trailer_len(header.flags);
+                    if (reserve_body(size)) {
+                        read_body(header);
+                    }
+                    else if (header.req_type == request_type::req_res || header.req_type == request_type::oneway) {
+                        discard_body(header, size);
                     }
                     else {
-                        print(ec);
+                        print("receive memory limit exceeded");
                         close();
                     }
-                });
+                    return;
+                }
+
+                if (body_len == 0) {  // nobody, just head, maybe as heartbeat.
+                    cancel_timer();
+                    if (header.req_type == request_type::cancel) {
+                        cancel_request(header.req_id);
+                    }
+                    read_head();
+                }
+                else {
+                    print("invalid body len");
+                    close();
+                }
             }
 
-            void read_body(std::size_t size) {
+            void read_body(frame_header header) {
                 auto self(this->shared_from_this());
-                async_read(size, [this, self](boost::system::error_code ec, std::size_t length) {
+                async_read(header.body_len + trailer_len(header.flags), [this, self, header](boost::system::error_code ec, std::size_t length) mutable {
                     cancel_timer();
 
                     if (!socket_.is_open()) {
@@ -172,11 +455,66 @@ namespace rest_rpc {
                     }
 
                     if (!ec) {
-                        read_head();
-                        if (req_type_ == request_type::req_res) {
-                            router_.route<connection>(body_.data(), length, this->shared_from_this());
+                        decode_trailer(body_.data() + header.body_len, header);
+                        header.received = std::chrono::steady_clock::now();
+                        if (header.flags & FLAG_DEADLINE) {
+                            header.deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(header.deadline_ms);
+                        }
+                        length = header.body_len;
+                        if ((header.flags & FLAG_COMPRESSED) && !decompress_body(length)) {
+                            print("invalid compressed body");
+                            close();
+                            return;
+                        }
+
+                        const auto req_id = header.req_id;
+                        const auto req_type = header.req_type;
+                        if (req_type == request_type::req_res || req_type == request_type::oneway) {
+                            start_trace(header);
+                            get_flight_recorder().record(flight_phase::request_read, conn_id_, req_id, header.method_id, length);
+                            if (!admit(header)) {
+                                get_flight_recorder().record(flight_phase::rejected, conn_id_, req_id, header.method_id);
+                                read_head();
+                                if (req_type == request_type::req_res) {
+                                    response(req_id, msgpack_codec::pack_args_str(result_code::OVERLOADED, "server overloaded"));
+                                }
+                            }
+                            else if (router_.has_executor()) {
+                                // hand the body over to the request, the next read_head refills body_
+                                auto buf = std::make_shared<std::vector<char>>();
+                                buf->swap(body_);
+                                auto borrowed = borrowed_;
+                                borrowed_ = 0;
+                                body_capacity_ = 0;
+                                read_head();
+                                router_.execute([this, self, buf, borrowed, header, length] {
+                                    route(header, buf->data(), length);
+                                    if (borrowed != 0) {
+                                        buffers_.release(borrowed, std::move(*buf));
+                                    }
+                                });
+                                return;
+                            }
+                            else {
+                                read_head();
+                                route(header, body_.data(), length);
+                            }
+                        }
+                        else if (req_type == request_type::stream_open) {
+                            read_head();
+                            open_stream(req_id, body_.data(), length);
                         }
-                        else if (req_type_ == request_type::sub_pub) {
+                        else if (req_type == request_type::stream_data || req_type == request_type::stream_end
+                            || req_type == request_type::stream_ack) {
+                            read_head();
+                            on_stream_frame(req_id, req_type, body_.data(), length);
+                        }
+                        else if (req_type == request_type::negotiate) {
+                            read_head();
+                            negotiate(req_id, body_.data(), length);
+                        }
+                        else if (req_type == request_type::sub_pub) {
+                            read_head();
                             try {
                                 msgpack_codec codec;
                                 auto p = codec.unpack<std::tuple<std::string, std::string>>(body_.data(), length);
@@ -186,6 +524,11 @@ namespace rest_rpc {
                                 print(ex);
                             }                            
                         }
+                        else {
+                            read_head();
+                        }
+
+                        release_body();
                     }
                     else {
                         //LOG(INFO) << ec.message();
@@ -193,17 +536,330 @@ namespace rest_rpc {
                 });
             }
 
+            // the receive memory limit has no room for this request: read its body away through
+            // body_ and answer it OVERLOADED, the connection stays usable
+            void discard_body(frame_header header, size_t remaining) {
+                if (body_.size() < MAX_RETAINED_BUF_LEN) {
+                    body_.resize(MAX_RETAINED_BUF_LEN);
+                    body_capacity_ = body_.capacity();
+                }
+
+                auto self(this->shared_from_this());
+                size_t size = (std::min)(remaining, body_.size());
+                async_read(size, [this, self, header, remaining, size](boost::system::error_code ec, std::size_t length) {
+                    if (ec) {
+                        print(ec);
+                        close();
+                        return;
+                    }
+
+                    if (remaining > size) {
+                        discard_body(header, remaining - size);
+                        return;
+                    }
+
+                    cancel_timer();
+                    get_flight_recorder().record(flight_phase::rejected, conn_id_, header.req_id, header.method_id);
+                    read_head();
+                    if (header.req_type == request_type::req_res) {
+                        response(header.req_id, msgpack_codec::pack_args_str(result_code::OVERLOADED, "receive memory limit exceeded"));
+                    }
+                });
+            }
+
+            // small bodies reuse body_, large ones are borrowed from the server's buffer_pool
+            bool reserve_body(std::size_t size) {
+                if (body_.size() >= size) {
+                    return true;
+                }
+
+                if (size <= MAX_RETAINED_BUF_LEN) {
+                    body_.resize(size);
+                    body_capacity_ = body_.capacity();
+                    return true;
+                }
+
+                std::vector<char> buf;
+                if (!buffers_.acquire(size, buf)) {
+                    return false;
+                }
+
+                release_body();
+                body_.swap(buf);
+                borrowed_ = size;
+                body_capacity_ = body_.capacity();
+                return true;
+            }
+
+            // give a large body back once the request is done with it
+            void release_body() {
+                if (borrowed_ == 0) {
+                    return;
+                }
+
+                buffers_.release(borrowed_, std::move(body_));
+                borrowed_ = 0;
+                body_ = std::vector<char>(INIT_BUF_SIZE);
+                body_capacity_ = body_.capacity();
+            }
+
+            // replace the compressed body_ by its original bytes, within the same limits as a plain body
+            bool decompress_body(std::size_t& length) {
+                auto type = compression_.load();
+                auto size = original_size(body_.data(), length);
+                if (type == compress_type::none || size == 0 || size >= max_frame_size_) {
+                    return false;
+                }
+
+                std::vector<char> plain;
+                if (size > MAX_RETAINED_BUF_LEN) {
+                    if (!buffers_.acquire(size, plain)) {
+                        return false;
+                    }
+                }
+                else {
+                    plain.resize(size);
+                }
+
+                bool ok = decompress(type, body_.data(), length, plain.data(), size);
+                release_body();
+                body_.swap(plain);
+                borrowed_ = size > MAX_RETAINED_BUF_LEN ? size : 0;
+                body_capacity_ = body_.capacity();
+                length = size;
+                return ok;
+            }
+
+            // the client sent its limit, codecs and header version: both sides use the smaller limit
+            // and version, and compress with the first offered codec we have if compression is enabled.
+            // Headers we write switch to v2 from the reply on, compression needs their flags.
+            void negotiate(std::uint64_t req_id, const char* data, std::size_t size) {
+                uint8_t version = 1;
+                try {
+                    msgpack_codec codec;
+                    auto tp = codec.unpack<std::tuple<uint64_t, std::vector<int>, int>>(data, size);
+                    auto limit = std::get<0>(tp);
+                    if (limit > 0 && limit < max_frame_size_) {
+                        max_frame_size_ = (size_t)limit;
+                    }
+
+                    version = (uint8_t)(std::min)(std::get<2>(tp), (int)HEADER_VERSION);
+                    if (version >= 2) {
+                        std::unique_lock<std::mutex> lock(write_mtx_);
+                        write_v2_ = true;
+                    }
+
+                    if (compress_threshold_ != 0 && version >= 2) {
+                        for (auto type : std::get<1>(tp)) {
+                            if (is_compression_supported((compress_type)type)) {
+                                compression_ = (compress_type)type;
+                                break;
+                            }
+                        }
+                    }
+                }
+                catch (const std::exception& ex) {
+                    print(ex);
+                }
+
+                auto buf = msgpack_codec::pack_args((uint64_t)max_frame_size_, (int)compression_.load(), (int)version);
+                response(req_id, std::string(buf.data(), buf.size()), request_type::negotiate);
+            }
+
+            // only requests not answered yet can be cancelled, a late cancel is ignored
+            void cancel_request(std::uint64_t req_id) {
+                std::unique_lock<std::mutex> lock(pending_mtx_);
+                auto it = pending_.find(req_id);
+                if (it != pending_.end()) {
+                    it->second.cancelled = true;
+                }
+            }
+
+            // count the request against the admission limits until it is answered
+            bool admit(const frame_header& header) {
+                if (!admission_.try_acquire(header.method_id, requests_)) {
+                    return false;
+                }
+
+                requests_++;
+                if (header.req_id != 0) {
+                    std::unique_lock<std::mutex> lock(pending_mtx_);
+                    pending_.emplace(header.req_id, pending_request{ false, header.method_id, std::chrono::steady_clock::now() });
+                }
+                return true;
+            }
+
+            void end_request(uint32_t method, std::chrono::steady_clock::duration latency, bool answered) {
+                requests_--;
+                admission_.release(method, latency, answered);
+            }
+
+            // the requests nobody will answer any more leave the admission limits
+            void end_pending_requests() {
+                std::unordered_map<std::uint64_t, pending_request> pending;
+                {
+                    std::unique_lock<std::mutex> lock(pending_mtx_);
+                    pending.swap(pending_);
+                }
+
+                for (auto& request : pending) {
+                    end_request(request.second.method_id, std::chrono::steady_clock::duration::zero(), false);
+                }
+            }
+
+            void open_stream(std::uint64_t stream_id, const char* data, std::size_t size) {
+                std::weak_ptr<connection> weak = this->shared_from_this();
+                auto stream = std::make_shared<rpc_stream>(stream_id, [weak, stream_id](request_type type, std::string frame) {
+                    auto conn = weak.lock();
+                    if (conn) {
+                        conn->response(stream_id, std::move(frame), type);
+                    }
+                });
+                stream->set_max_chunk_size(max_frame_size_ - 1);
+                stream->set_done_callback([weak, stream_id] {
+                    auto conn = weak.lock();
+                    if (conn) {
+                        std::unique_lock<std::mutex> lock(conn->streams_mtx_);
+                        conn->streams_.erase(stream_id);
+                    }
+                });
+
+                {
+                    std::unique_lock<std::mutex> lock(streams_mtx_);
+                    if (!streams_.emplace(stream_id, stream).second) {
+                        print("duplicated stream id", stream_id);
+                        return;
+                    }
+                }
+
+                router_.route_stream<connection>(data, size, this->shared_from_this(), stream);
+            }
+
+            void on_stream_frame(std::uint64_t stream_id, request_type type, const char* data, std::size_t size) {
+                stream_ptr stream;
+                {
+                    std::unique_lock<std::mutex> lock(streams_mtx_);
+                    auto it = streams_.find(stream_id);
+                    if (it == streams_.end()) {
+                        return;
+                    }
+                    stream = it->second;
+                }
+
+                try {
+                    if (type == request_type::stream_data) {
+                        stream->on_data(data, size);
+                    }
+                    else if (type == request_type::stream_end) {
+                        stream->on_end(data, size);
+                    }
+                    else {
+                        stream->on_ack(data, size);
+                    }
+                }
+                catch (const std::exception& ex) {
+                    print(ex);
+                }
+            }
+
+            // requests sent with a trace context are traced, the others are sampled
+            void start_trace(frame_header& header) {
+                if (header.trace_id == 0) {
+                    if (header.head_received == std::chrono::steady_clock::time_point{} || !get_tracer().sample()) {
+                        return;
+                    }
+                    header.trace_id = tracer::new_id();
+                }
+
+                header.span_id = tracer::new_id();
+                trace_context context{ header.trace_id, header.span_id };
+                auto& t = get_tracer();
+                t.record(span_kind::read_header, context, tracer::new_id(), header.method_id, header.head_received, header.head_received);
+                t.record(span_kind::read_body, context, tracer::new_id(), header.method_id, header.head_received, header.received);
+            }
+
+            void route(const frame_header& header, const char* data, std::size_t size) {
+                auto& recorder = get_flight_recorder();
+                recorder.record(flight_phase::dispatched, conn_id_, header.req_id, header.method_id);
+                current_frame() = header;
+                current_connection() = this;
+                router_.route<connection>(data, size, this->shared_from_this());
+                current_connection() = nullptr;
+                current_frame() = frame_header{};
+                recorder.record(flight_phase::completed, conn_id_, header.req_id, header.method_id);
+                if (header.trace_id != 0) {
+                    current_trace() = trace_context{};
+                    get_tracer().record(span_kind::server, trace_context{ header.trace_id, header.parent_span_id }, header.span_id,
+                        header.method_id, header.head_received, std::chrono::steady_clock::now());
+                }
+                if (header.req_id == 0) {
+                    // oneway calls get no response, they are done once their handler returned
+                    end_request(header.method_id, std::chrono::steady_clock::duration::zero(), false);
+                }
+            }
+
+            // header of the request being dispatched on the calling thread
+            static frame_header& current_frame() {
+                static thread_local frame_header header{};
+                return header;
+            }
+
+            // the connection current_frame() belongs to
+            static const connection*& current_connection() {
+                static thread_local const connection* conn = nullptr;
+                return conn;
+            }
+
+            void start_flush_timer() {
+                auto self = this->shared_from_this();
+                flush_timer_.expires_from_now(coalesce_delay_);
+                flush_timer_.async_wait([this, self](const boost::system::error_code& ec) {
+                    if (ec || has_closed()) { return; }
+
+                    std::unique_lock<std::mutex> lock(write_mtx_);
+                    if (!flush_pending_ || writing_) { return; }
+
+                    flush_pending_ = false;
+                    writing_ = true;
+                    write();
+                });
+            }
+
+            // send everything queued in one gathered write, called with write_mtx_ held
             void write() {
-                auto& msg = write_queue_.front();
-                write_size_ = (uint32_t)msg.content->size();
-                std::array<boost::asio::const_buffer, 4> write_buffers;
-                write_buffers[0] = boost::asio::buffer(&write_size_, sizeof(uint32_t));
-                write_buffers[1] = boost::asio::buffer(&msg.req_id, sizeof(uint64_t));
-                write_buffers[2] = boost::asio::buffer(&msg.req_type, sizeof(request_type));
-                write_buffers[3] = boost::asio::buffer(msg.content->data(), write_size_);
+                sending_.clear();
+                while (!write_queue_.empty() && sending_.size() < MAX_WRITE_BATCH) {
+                    bool has_file = write_queue_.front().file != nullptr;
+                    sending_.push_back(std::move(write_queue_.front()));
+                    write_queue_.pop_front();
+                    if (has_file) {
+                        // the file part follows the gathered buffers, see send_file
+                        break;
+                    }
+                }
+
+                size_t bytes = 0;
+                write_heads_.resize(sending_.size());
+                write_buffers_.clear();
+                for (size_t i = 0; i < sending_.size(); ++i) {
+                    auto& msg = sending_[i];
+                    size_t body_len = msg.content->size() + (msg.file ? msg.file->length : 0);
+                    frame_header header{ msg.req_id, msg.req_type, msg.flags, (uint32_t)body_len };
+                    size_t head_len = encode_head(header, write_v2_, write_heads_[i].data());
+                    write_buffers_.push_back(boost::asio::buffer(write_heads_[i].data(), head_len));
+                    write_buffers_.push_back(boost::asio::buffer(msg.content->data(), msg.content->size()));
+                    queued_bytes_ -= body_len;
+                    bytes += head_len + body_len;
+                }
+                sending_bytes_ = bytes;
+
+                write_stats_.writes++;
+                write_stats_.messages += sending_.size();
+                write_stats_.bytes += bytes;
+                write_stats_.max_batch = (std::max)(write_stats_.max_batch, (uint64_t)sending_.size());
 
                 auto self = this->shared_from_this();
-                async_write(write_buffers,
+                async_write(write_buffers_,
                     [this, self](boost::system::error_code ec, std::size_t length) {
                     on_write(ec, length);
                 });
@@ -218,12 +874,134 @@ namespace rest_rpc {
 
                 if (has_closed()) { return; }
 
+                {
+                    std::unique_lock<std::mutex> lock(write_mtx_);
+                    sending_file_ = sending_.back().file;
+                }
+
+                if (sending_file_) {
+                    file_offset_ = sending_file_->offset;
+                    file_remaining_ = sending_file_->length;
+                    send_file();
+                    return;
+                }
+
+                write_next();
+            }
+
+            // called with write_mtx_ held once the responses being sent are written
+            void on_written() {
+                auto& recorder = get_flight_recorder();
+                std::chrono::steady_clock::time_point now;
+                for (auto& msg : sending_) {
+                    if (msg.req_type == request_type::req_res) {
+                        recorder.record(flight_phase::response_written, conn_id_, msg.req_id, msg.method_id);
+                    }
+                    if (msg.trace_id == 0) {
+                        continue;
+                    }
+
+                    if (now == std::chrono::steady_clock::time_point{}) {
+                        now = std::chrono::steady_clock::now();
+                    }
+                    get_tracer().record(span_kind::write, trace_context{ msg.trace_id, msg.span_id }, tracer::new_id(),
+                        msg.method_id, msg.queued, now);
+                }
+            }
+
+            void write_next() {
                 std::unique_lock<std::mutex> lock(write_mtx_);
-                write_queue_.pop_front();
+                on_written();
+                sending_.clear();
+                sending_bytes_ = 0;
 
                 if (!write_queue_.empty()) {
                     write();
                 }
+                else {
+                    writing_ = false;
+                }
+
+                if (read_paused_ && queued_bytes_ + sending_bytes_ <= low_water_) {
+                    read_paused_ = false;
+                    lock.unlock();
+                    read_head();
+                }
+            }
+
+            void send_file() {
+                auto self = this->shared_from_this();
+#ifdef __linux__
+                if (!is_ssl()) {
+                    boost::system::error_code ec;
+                    socket_.native_non_blocking(true, ec);
+                    while (file_remaining_ > 0) {
+                        off_t offset = (off_t)file_offset_;
+                        ssize_t n = ::sendfile(socket_.native_handle(), sending_file_->fd, &offset, file_remaining_);
+                        if (n > 0) {
+                            file_offset_ += n;
+                            file_remaining_ -= n;
+                            continue;
+                        }
+
+                        if (n < 0 && errno == EINTR) {
+                            continue;
+                        }
+
+                        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                            socket_.async_wait(tcp::socket::wait_write, [this, self](boost::system::error_code ec) {
+                                if (ec) {
+                                    print(ec);
+                                    close(false);
+                                    return;
+                                }
+
+                                send_file();
+                            });
+                            return;
+                        }
+
+                        // error, or the file is shorter than announced and the frame can't be completed
+                        print("sendfile failed");
+                        close(false);
+                        return;
+                    }
+
+                    sending_file_ = nullptr;
+                    write_next();
+                    return;
+                }
+#endif
+#ifndef _WIN32
+                // the bytes have to be encrypted: go through a bounded buffer
+                file_buf_.resize((std::min)(file_remaining_, (uint64_t)STREAM_CHUNK_SIZE));
+                ssize_t n = ::pread(sending_file_->fd, &file_buf_[0], file_buf_.size(), (off_t)file_offset_);
+                if (n <= 0) {
+                    print("read file failed");
+                    close(false);
+                    return;
+                }
+
+                file_offset_ += n;
+                file_remaining_ -= n;
+                async_write(boost::asio::buffer(file_buf_.data(), n), [this, self](boost::system::error_code ec, std::size_t length) {
+                    if (ec) {
+                        print(ec);
+                        close(false);
+                        return;
+                    }
+
+                    if (file_remaining_ > 0) {
+                        send_file();
+                        return;
+                    }
+
+                    sending_file_ = nullptr;
+                    write_next();
+                });
+#else
+                close(false);
+#endif
             }
 
             void async_handshake() {
@@ -252,14 +1030,14 @@ namespace rest_rpc {
             }
 
             template<typename Handler>
-            void async_read_head(Handler handler) {
+            void async_read_head(size_t size, Handler handler, size_t offset = 0) {
                 if (is_ssl()) {
 #ifdef CINATRA_ENABLE_SSL
-                    boost::asio::async_read(*ssl_stream_, boost::asio::buffer(head_, HEAD_LEN), std::move(handler));
+                    boost::asio::async_read(*ssl_stream_, boost::asio::buffer(head_ + offset, size), std::move(handler));
 #endif
                 }
                 else {
-                    boost::asio::async_read(socket_, boost::asio::buffer(head_, HEAD_LEN), std::move(handler));
+                    boost::asio::async_read(socket_, boost::asio::buffer(head_ + offset, size), std::move(handler));
                 }
             }
 
@@ -325,6 +1103,9 @@ namespace rest_rpc {
                 socket_.close(ignored_ec);
                 has_closed_ = true;
                 has_shake_ = false;
+                get_flight_recorder().record(flight_phase::closed, conn_id_, 0, 0);
+                abort_streams();
+                end_pending_requests();
             }
 
             template<typename... Args>
@@ -343,27 +1124,65 @@ namespace rest_rpc {
                 print(ex.what());
             }
 
+            boost::asio::io_service& io_service_;
             tcp::socket socket_;
 #ifdef CINATRA_ENABLE_SSL
             std::unique_ptr<boost::asio::ssl::stream<boost::asio::ip::tcp::socket&>> ssl_stream_ = nullptr;
 #endif
             bool has_shake_ = false;
-            char head_[HEAD_LEN];
+            char head_[HEAD_LEN_V2];
+            bool read_v2_ = false;
             std::vector<char> body_;
-            std::uint64_t req_id_;
-            request_type req_type_;
+            size_t borrowed_ = 0;
+            std::atomic<size_t> max_frame_size_ = { MAX_BUF_LEN };
+            size_t compress_threshold_ = 0;
+            std::atomic<compress_type> compression_ = { compress_type::none };
+            std::atomic<size_t> body_capacity_ = { INIT_BUF_SIZE };
+
+            struct pending_request {
+                bool cancelled;
+                uint32_t method_id;
+                std::chrono::steady_clock::time_point start;
+            };
+
+            std::mutex pending_mtx_;
+            std::unordered_map<std::uint64_t, pending_request> pending_;  // requests waiting for their response
+            std::atomic<size_t> requests_ = { 0 };  // admitted and not answered yet
 
-            uint32_t write_size_ = 0;
             std::mutex write_mtx_;
+            std::deque<message_type> write_queue_;
+            std::vector<message_type> sending_;
+            std::vector<std::array<char, HEAD_LEN_V2>> write_heads_;
+            bool write_v2_ = false;
+            std::vector<boost::asio::const_buffer> write_buffers_;
+            size_t queued_bytes_ = 0;
+            size_t sending_bytes_ = 0;
+            size_t high_water_ = WRITE_QUEUE_HIGH_WATER;
+            size_t low_water_ = WRITE_QUEUE_LOW_WATER;
+            bool read_paused_ = false;
+            bool writing_ = false;
+            bool flush_pending_ = false;
+            std::chrono::microseconds coalesce_delay_{ 0 };
+            size_t coalesce_bytes_ = 0;
+            write_stats write_stats_;
+            std::shared_ptr<file_region> sending_file_;
+            uint64_t file_offset_ = 0;
+            uint64_t file_remaining_ = 0;
+            std::vector<char> file_buf_;
 
             asio::steady_timer timer_;
+            asio::steady_timer flush_timer_;
             std::size_t timeout_seconds_;
             int64_t conn_id_ = 0;
             bool has_closed_;
 
-            std::deque<message_type> write_queue_;
+            std::unordered_map<std::uint64_t, stream_ptr> streams_;
+            std::mutex streams_mtx_;
+
             std::function<void(std::string, std::string, std::weak_ptr<connection>)> callback_;
       router& router_;
+            buffer_pool& buffers_;
+            admission_control& admission_;
         };
     }  // namespace rpc_service
 }  // namespace rest_rpc
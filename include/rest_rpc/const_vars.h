@@ -1,4 +1,5 @@
 #pragma once
+#include <chrono>
 #include <cstdint>
 
 namespace rest_rpc {
@@ -6,6 +7,7 @@ namespace rest_rpc {
     enum class result_code : std::int16_t {
         OK = 0,
         FAIL = 1,
+        OVERLOADED = 2,  // rejected by the server's admission control without being run
     };
 
     enum class error_code {
@@ -19,13 +21,35 @@ namespace rest_rpc {
 
     enum class request_type : uint8_t {
         req_res,
-        sub_pub
+        sub_pub,
+        stream_open,  // (rpc_name, args...) of a streaming rpc, req_id is the stream id
+        stream_data,  // a raw chunk
+        stream_end,   // the sender finished its side: (result_code, message)
+        stream_ack,   // flow control, bytes consumed by the receiver
+        oneway,       // a call nobody waits for, req_id is 0 and no response is sent
+        negotiate,    // client: (max frame size, [compress_type...], header version), server: the chosen ones;
+                      // it started out as the frame size only and was called frame_limit then
+        cancel,       // no body, the client gave up on req_id and wants no response
     };
 
+    enum class compress_type : uint8_t {
+        none,
+        lz4,
+        zstd,
+    };
+
+    struct file_region;
+
     struct message_type {
         std::uint64_t req_id;
         request_type req_type;
         std::shared_ptr<std::string> content;
+        std::shared_ptr<file_region> file;  // sent after content when set
+        uint8_t flags;  // v2 header flags of content, e.g. FLAG_COMPRESSED
+        uint64_t trace_id;  // the response of a traced request, see trace.h
+        uint64_t span_id;
+        uint32_t method_id;
+        std::chrono::steady_clock::time_point queued;
     };
 
 
@@ -35,9 +59,49 @@ namespace rest_rpc {
         uint64_t req_id;
         request_type req_type;
     };
+
+    // the header once both peers negotiated version 2. magic is where a legacy header has the high
+    // byte of body_len, a legacy frame can't be that large so the formats can't be confused.
+    // The optional fields announced by flags follow the body, see frame.h.
+    struct rpc_header_v2 {
+        uint8_t version;
+        uint8_t flags;
+        request_type req_type;
+        uint8_t magic;
+        uint32_t body_len;
+        uint64_t req_id;
+    };
 #pragma pack ()
 
-    static const size_t MAX_BUF_LEN = 1048576 * 10;
+    static const size_t MAX_BUF_LEN = 1048576 * 10;  // default max frame size, see set_max_frame_size
     static const size_t HEAD_LEN = 13;
+    static const size_t HEAD_LEN_V2 = 16;
+    static const uint8_t HEADER_MAGIC = 0xB5;
+    static const uint8_t HEADER_VERSION = 2;
+    static const size_t MAX_FRAME_LIMIT = 0x7fffffff;  // a legacy body_len never reaches HEADER_MAGIC
+
+    // flags of a v2 header
+    static const uint8_t FLAG_COMPRESSED = 0x01;
+    static const uint8_t FLAG_STREAMING = 0x02;
+    static const uint8_t FLAG_ONEWAY = 0x04;
+    static const uint8_t FLAG_METHOD_ID = 0x08;  // uint32 method id after the body
+    static const uint8_t FLAG_DEADLINE = 0x10;   // uint32 milliseconds left after the body
+    static const uint8_t FLAG_TRACE = 0x20;      // uint64 trace id and uint64 parent span id after the body
     static const size_t INIT_BUF_SIZE = 2 * 1024;
+    static const size_t MAX_RETAINED_BUF_LEN = 64 * 1024;  // bigger receive buffers are released after the request
+    static const size_t MAX_WRITE_BATCH = 256;  // messages gathered into one socket write
+    static const size_t WRITE_QUEUE_HIGH_WATER = 32 * 1024 * 1024;  // unwritten response bytes pausing reads
+    static const size_t WRITE_QUEUE_LOW_WATER = 8 * 1024 * 1024;    // reads resume below it
+    static const size_t STREAM_WINDOW = 1024 * 1024;  // unacknowledged bytes in flight per stream
+    static const size_t STREAM_CHUNK_SIZE = 64 * 1024;
+    static const size_t STREAM_TIMEOUT_MS = 30 * 1000;  // a stream read or write waiting longer for the peer fails
+    static const size_t STREAM_HANDLER_THREADS = 4;     // stream handlers running at once, see rpc_server::set_stream_threads
+    static const size_t COMPRESS_THRESHOLD = 4 * 1024;  // smaller payloads are sent as is
+
+    // reserved rpc name of a frame carrying several packed calls
+    static const char BATCH_RPC_NAME[] = "__batch";
+    // reserved rpc name of the server's built-in statistics call, see rpc_server::get_stats
+    static const char STATS_RPC_NAME[] = "__stats";
+    // reserved rpc name returning the server's flight recorder: ("json" or "binary") -> string
+    static const char FLIGHT_RECORDER_RPC_NAME[] = "__flight_recorder";
 }
\ No newline at end of file
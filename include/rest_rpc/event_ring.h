@@ -0,0 +1,53 @@
+#ifndef REST_RPC_EVENT_RING_H_
+#define REST_RPC_EVENT_RING_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+namespace rest_rpc {
+    /**
+     * The last N events of one thread, N a power of two. Only its thread pushes, without locks; an
+     * event is overwritten once N newer ones were pushed. The reader checks head again after copying
+     * to drop the events overwritten meanwhile, as a seqlock does.
+     */
+    template<typename T, size_t N>
+    class event_ring {
+        static_assert(N != 0 && (N & (N - 1)) == 0, "the size of an event_ring is a power of two");
+
+    public:
+        void push(const T& event) {
+            auto head = head_.load(std::memory_order_relaxed);
+            slots_[head & (N - 1)] = event;
+            head_.store(head + 1, std::memory_order_release);
+        }
+
+        // appends the events numbered since and later which are still in the ring, returns the number
+        // of the next event
+        uint64_t copy(std::vector<T>& out, uint64_t since = 0) const {
+            auto head = head_.load(std::memory_order_acquire);
+            auto begin = (std::max)(since, head > N ? head - N : 0);
+            size_t first = out.size();
+            for (auto i = begin; i < head; ++i) {
+                out.push_back(slots_[i & (N - 1)]);
+            }
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            // the writer may be in the middle of writing slot now, which held event now - N
+            auto now = head_.load(std::memory_order_relaxed);
+            if (now + 1 > N + begin) {
+                size_t overwritten = (size_t)(std::min)(now + 1 - N - begin, head - begin);
+                out.erase(out.begin() + first, out.begin() + first + overwritten);
+            }
+            return head;
+        }
+
+    private:
+        std::array<T, N> slots_;
+        std::atomic<uint64_t> head_{ 0 };
+    };
+}  // namespace rest_rpc
+
+#endif  // REST_RPC_EVENT_RING_H_
@@ -0,0 +1,61 @@
+#ifndef REST_RPC_FILE_REGION_H_
+#define REST_RPC_FILE_REGION_H_
+
+#include <cstdint>
+#include <memory>
+#include <string>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace rest_rpc {
+    /**
+     * A part of a file sent as the string result of a request by connection::response_file,
+     * the bytes go from the page cache to the socket with sendfile, never through user space.
+     */
+    struct file_region {
+        file_region(int fd, uint64_t offset, uint64_t length, bool own_fd = true)
+            : fd(fd), offset(offset), length(length), own_fd(own_fd) {
+        }
+
+        ~file_region() {
+#ifndef _WIN32
+            if (own_fd && fd >= 0) {
+                ::close(fd);
+            }
+#endif
+        }
+
+        file_region(const file_region&) = delete;
+        file_region& operator=(const file_region&) = delete;
+
+        // the whole file, nullptr if it can't be opened
+        static std::shared_ptr<file_region> open(const std::string& filename) {
+#ifndef _WIN32
+            int fd = ::open(filename.c_str(), O_RDONLY);
+            if (fd < 0) {
+                return nullptr;
+            }
+
+            struct stat st;
+            if (::fstat(fd, &st) != 0) {
+                ::close(fd);
+                return nullptr;
+            }
+
+            return std::make_shared<file_region>(fd, 0, (uint64_t)st.st_size);
+#else
+            return nullptr;
+#endif
+        }
+
+        int fd;
+        uint64_t offset;
+        uint64_t length;
+        bool own_fd;
+    };
+}  // namespace rest_rpc
+
+#endif  // REST_RPC_FILE_REGION_H_
@@ -0,0 +1,191 @@
+#ifndef REST_RPC_FLIGHT_RECORDER_H_
+#define REST_RPC_FLIGHT_RECORDER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include "event_ring.h"
+
+namespace rest_rpc {
+    namespace rpc_service {
+        enum class flight_phase : uint8_t {
+            request_read,      // bytes: the request body
+            rejected,          // by admission control
+            dispatched,        // a worker or io thread starts routing the request
+            completed,         // routing returned, an async handler may still be running
+            response_queued,   // bytes: the response
+            response_written,  // the socket write including the response completed
+            closed,            // the connection closed
+        };
+
+        inline const char* flight_phase_name(flight_phase phase) {
+            static const char* names[] = { "request_read", "rejected", "dispatched", "completed",
+                "response_queued", "response_written", "closed" };
+            return names[(size_t)phase];
+        }
+
+        struct flight_event {
+            uint64_t time_ns;  // steady clock
+            uint64_t req_id;
+            int64_t conn_id;
+            uint32_t method_id;
+            uint32_t bytes;
+            uint16_t thread;   // the ring which recorded it
+            flight_phase phase;
+        };
+
+        static const size_t FLIGHT_RECORDER_SIZE = 8192;  // events kept per thread, a power of two
+        static const char FLIGHT_RECORDER_MAGIC[] = "RRFLIGHT";
+
+        /**
+         * Always on: each thread records the last FLIGHT_RECORDER_SIZE events of the requests it
+         * handled into its own ring, for a look at what happened before a latency incident. An event
+         * costs a clock read and a 40 byte store.
+         */
+        class flight_recorder {
+        public:
+            flight_recorder(const flight_recorder&) = delete;
+            flight_recorder& operator=(const flight_recorder&) = delete;
+
+            void set_enabled(bool enabled) { enabled_ = enabled; }
+
+            void record(flight_phase phase, int64_t conn_id, uint64_t req_id, uint32_t method_id, size_t bytes = 0) {
+                if (!enabled_.load(std::memory_order_relaxed)) {
+                    return;
+                }
+
+                auto& ring = local_ring();
+                auto now = std::chrono::steady_clock::now().time_since_epoch();
+                ring.events.push(flight_event{ (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(now).count(),
+                    req_id, conn_id, method_id, (uint32_t)(std::min)(bytes, (size_t)UINT32_MAX), ring.index, phase });
+            }
+
+            // the events of all the threads still in their rings, oldest first
+            std::vector<flight_event> snapshot() const {
+                std::vector<flight_event> events;
+                {
+                    std::unique_lock<std::mutex> lock(mtx_);
+                    for (auto& ring : rings_) {
+                        ring->events.copy(events);
+                    }
+                }
+
+                std::sort(events.begin(), events.end(), [](const flight_event& a, const flight_event& b) {
+                    return a.time_ns < b.time_ns;
+                });
+                return events;
+            }
+
+            // FLIGHT_RECORDER_MAGIC, the event count as a uint64 and the flight_events as they are in memory
+            static std::string to_binary(const std::vector<flight_event>& events) {
+                std::string out(FLIGHT_RECORDER_MAGIC, sizeof(FLIGHT_RECORDER_MAGIC) - 1);
+                uint64_t count = events.size();
+                out.append((const char*)&count, sizeof(count));
+                out.append((const char*)events.data(), events.size() * sizeof(flight_event));
+                return out;
+            }
+
+            // s as the contents of a JSON string
+            static std::string json_escape(const std::string& s) {
+                std::string out;
+                out.reserve(s.size());
+                for (char c : s) {
+                    if (c == '"' || c == '\\') {
+                        out += '\\';
+                        out += c;
+                    } else if ((unsigned char)c < 0x20) {
+                        char hex[8];
+                        snprintf(hex, sizeof(hex), "\\u%04x", (unsigned)c);
+                        out += hex;
+                    } else {
+                        out += c;
+                    }
+                }
+                return out;
+            }
+
+            // the Chrome trace event format, for chrome://tracing or Perfetto; names maps method ids
+            // to method names
+            static std::string to_chrome_trace(const std::vector<flight_event>& events,
+                const std::unordered_map<uint32_t, std::string>& names) {
+                std::unordered_map<uint32_t, std::string> escaped;
+                for (auto& name : names) {
+                    escaped.emplace(name.first, json_escape(name.second));
+                }
+
+                std::string out = "{\"traceEvents\":[";
+                out.reserve(events.size() * 160);
+                char line[320];  // everything but the method name, fixed width numbers fit easily
+                for (size_t i = 0; i < events.size(); ++i) {
+                    auto& e = events[i];
+                    snprintf(line, sizeof(line),
+                        "%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":1,\"tid\":%u,"
+                        "\"args\":{\"conn_id\":%lld,\"req_id\":%llu,\"bytes\":%u,\"method\":\"",
+                        i == 0 ? "" : ",\n", flight_phase_name(e.phase), e.time_ns / 1000.0, (unsigned)e.thread,
+                        (long long)e.conn_id, (unsigned long long)e.req_id, (unsigned)e.bytes);
+                    out += line;
+                    auto it = escaped.find(e.method_id);
+                    if (it != escaped.end()) {
+                        out += it->second;
+                    }
+                    out += "\"}}";
+                }
+                out += "]}\n";
+                return out;
+            }
+
+            // writes the snapshot to path, as Chrome trace JSON if path ends with .json
+            bool dump(const std::string& path, const std::unordered_map<uint32_t, std::string>& names) const {
+                auto events = snapshot();
+                bool json = path.size() >= 5 && path.compare(path.size() - 5, 5, ".json") == 0;
+                auto data = json ? to_chrome_trace(events, names) : to_binary(events);
+                FILE* file = fopen(path.c_str(), "wb");
+                if (file == nullptr) {
+                    return false;
+                }
+
+                bool ok = fwrite(data.data(), 1, data.size(), file) == data.size();
+                return fclose(file) == 0 && ok;
+            }
+
+        private:
+            flight_recorder() = default;
+            friend flight_recorder& get_flight_recorder();
+
+            struct ring {
+                event_ring<flight_event, FLIGHT_RECORDER_SIZE> events;
+                uint16_t index;
+            };
+
+            ring& local_ring() {
+                static thread_local std::shared_ptr<ring> local;
+                if (local == nullptr) {
+                    local = std::make_shared<ring>();
+                    std::unique_lock<std::mutex> lock(mtx_);
+                    local->index = (uint16_t)rings_.size();
+                    rings_.push_back(local);
+                }
+                return *local;
+            }
+
+            std::atomic<bool> enabled_{ true };
+            mutable std::mutex mtx_;
+            // rings outlive their thread, the events of an exited thread are still dumped
+            std::vector<std::shared_ptr<ring>> rings_;
+        };
+
+        // the flight recorder of the process, the rings are per thread so there is only one
+        inline flight_recorder& get_flight_recorder() {
+            static flight_recorder recorder;
+            return recorder;
+        }
+    }  // namespace rpc_service
+}  // namespace rest_rpc
+
+#endif  // REST_RPC_FLIGHT_RECORDER_H_
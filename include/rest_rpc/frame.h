@@ -0,0 +1,116 @@
+#ifndef REST_RPC_FRAME_H_
+#define REST_RPC_FRAME_H_
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include "const_vars.h"
+
+namespace rest_rpc {
+    // a decoded header, legacy or v2, with the optional fields of a v2 frame
+    struct frame_header {
+        uint64_t req_id;
+        request_type req_type;
+        uint8_t flags;
+        uint32_t body_len;
+        uint32_t method_id;
+        uint32_t deadline_ms;  // time the sender still waits for the response
+        std::chrono::steady_clock::time_point deadline;  // set by the receiver from deadline_ms
+        std::chrono::steady_clock::time_point received;  // when the receiver read the frame
+        uint64_t trace_id;        // 0 if the request isn't traced
+        uint64_t parent_span_id;  // the sender's span
+        uint64_t span_id;         // the receiver's span, set by the receiver
+        std::chrono::steady_clock::time_point head_received;  // only taken while tracing
+    };
+
+    // the first HEAD_LEN bytes of a frame start a v2 header
+    inline bool is_v2_head(const char* head) {
+        return (uint8_t)head[3] == HEADER_MAGIC;
+    }
+
+    // size of the optional fields following the body
+    inline size_t trailer_len(uint8_t flags) {
+        return ((flags & FLAG_METHOD_ID) ? sizeof(uint32_t) : 0) + ((flags & FLAG_DEADLINE) ? sizeof(uint32_t) : 0) +
+            ((flags & FLAG_TRACE) ? 2 * sizeof(uint64_t) : 0);
+    }
+
+    // head holds HEAD_LEN bytes of a legacy header or HEAD_LEN_V2 bytes of a v2 one
+    inline frame_header decode_head(const char* head, bool v2) {
+        frame_header h{};
+        if (v2) {
+            rpc_header_v2 header;
+            memcpy(&header, head, sizeof(header));
+            h.req_id = header.req_id;
+            h.req_type = header.req_type;
+            h.flags = header.flags;
+            h.body_len = header.body_len;
+        }
+        else {
+            rpc_header header;
+            memcpy(&header, head, sizeof(header));
+            h.req_id = header.req_id;
+            h.req_type = header.req_type;
+            h.body_len = header.body_len;
+        }
+        return h;
+    }
+
+    inline void decode_trailer(const char* data, frame_header& h) {
+        if (h.flags & FLAG_METHOD_ID) {
+            memcpy(&h.method_id, data, sizeof(uint32_t));
+            data += sizeof(uint32_t);
+        }
+        if (h.flags & FLAG_DEADLINE) {
+            memcpy(&h.deadline_ms, data, sizeof(uint32_t));
+            data += sizeof(uint32_t);
+        }
+        if (h.flags & FLAG_TRACE) {
+            memcpy(&h.trace_id, data, sizeof(uint64_t));
+            memcpy(&h.parent_span_id, data + sizeof(uint64_t), sizeof(uint64_t));
+        }
+    }
+
+    // writes the header, HEAD_LEN or HEAD_LEN_V2 bytes, and returns its size
+    inline size_t encode_head(const frame_header& h, bool v2, char* out) {
+        if (v2) {
+            rpc_header_v2 header{ HEADER_VERSION, h.flags, h.req_type, HEADER_MAGIC, h.body_len, h.req_id };
+            memcpy(out, &header, sizeof(header));
+            return sizeof(header);
+        }
+
+        rpc_header header{ h.body_len, h.req_id, h.req_type };
+        memcpy(out, &header, sizeof(header));
+        return sizeof(header);
+    }
+
+    // writes the optional fields announced by h.flags and returns their size
+    inline size_t encode_trailer(const frame_header& h, char* out) {
+        size_t len = 0;
+        if (h.flags & FLAG_METHOD_ID) {
+            memcpy(out + len, &h.method_id, sizeof(uint32_t));
+            len += sizeof(uint32_t);
+        }
+        if (h.flags & FLAG_DEADLINE) {
+            memcpy(out + len, &h.deadline_ms, sizeof(uint32_t));
+            len += sizeof(uint32_t);
+        }
+        if (h.flags & FLAG_TRACE) {
+            memcpy(out + len, &h.trace_id, sizeof(uint64_t));
+            memcpy(out + len + sizeof(uint64_t), &h.parent_span_id, sizeof(uint64_t));
+            len += 2 * sizeof(uint64_t);
+        }
+        return len;
+    }
+
+    // FNV-1a of the rpc name, sent in the header so the server can tell the method without decoding the body
+    inline uint32_t method_id(const char* name, size_t size) {
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < size; ++i) {
+            hash ^= (uint8_t)name[i];
+            hash *= 16777619u;
+        }
+        return hash;
+    }
+}  // namespace rest_rpc
+
+#endif  // REST_RPC_FRAME_H_
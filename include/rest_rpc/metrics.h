@@ -0,0 +1,297 @@
+#ifndef REST_RPC_METRICS_H_
+#define REST_RPC_METRICS_H_
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "use_asio.hpp"
+
+namespace rest_rpc {
+    namespace rpc_service {
+        // where the time of a call goes: waiting for a worker, unpacking the arguments, running the
+        // handler, packing the result; total is from the frame being read to the result being packed.
+        enum class metric_phase : uint8_t {
+            queue,
+            decode,
+            handler,
+            encode,
+            total,
+        };
+
+        static const size_t METRIC_PHASES = 5;
+        static const size_t MAX_METRIC_METHODS = 256;  // handlers registered later are not measured
+        static const size_t HISTOGRAM_SUB_BUCKETS = 8;  // per power of two, values within 12.5%
+        static const size_t HISTOGRAM_BUCKETS = 40 * HISTOGRAM_SUB_BUCKETS;  // up to 2^40 ns, about 18 minutes
+
+        /**
+         * Log-linear histogram of nanoseconds in the style of HdrHistogram: values below
+         * HISTOGRAM_SUB_BUCKETS are exact, above each power of two is split in HISTOGRAM_SUB_BUCKETS.
+         */
+        class latency_histogram {
+        public:
+            static size_t bucket_of(uint64_t ns) {
+                if (ns < HISTOGRAM_SUB_BUCKETS) {
+                    return (size_t)ns;
+                }
+
+                size_t exp = 63 - leading_zeros(ns);  // >= 3
+                size_t sub = (size_t)(ns >> (exp - 3)) & (HISTOGRAM_SUB_BUCKETS - 1);
+                size_t bucket = (exp - 2) * HISTOGRAM_SUB_BUCKETS + sub;
+                return (std::min)(bucket, HISTOGRAM_BUCKETS - 1);
+            }
+
+            // the highest value counted in bucket
+            static uint64_t upper_bound(size_t bucket) {
+                if (bucket < HISTOGRAM_SUB_BUCKETS) {
+                    return bucket;
+                }
+
+                size_t exp = bucket / HISTOGRAM_SUB_BUCKETS + 2;
+                uint64_t sub = bucket % HISTOGRAM_SUB_BUCKETS;
+                return ((HISTOGRAM_SUB_BUCKETS + sub + 1) << (exp - 3)) - 1;
+            }
+
+            void add(size_t bucket, uint64_t n) {
+                counts_[bucket] += n;
+                count_ += n;
+            }
+
+            void add_sum(uint64_t ns) { sum_ += ns; }
+
+            uint64_t count() const { return count_; }
+
+            std::chrono::nanoseconds sum() const { return std::chrono::nanoseconds(sum_); }
+
+            // upper bound of the bucket holding the p quantile, p in [0, 1]
+            std::chrono::nanoseconds percentile(double p) const {
+                if (count_ == 0) {
+                    return std::chrono::nanoseconds(0);
+                }
+
+                uint64_t rank = (uint64_t)(p * (count_ - 1)) + 1;
+                uint64_t seen = 0;
+                for (size_t i = 0; i < HISTOGRAM_BUCKETS; ++i) {
+                    seen += counts_[i];
+                    if (seen >= rank) {
+                        return std::chrono::nanoseconds(upper_bound(i));
+                    }
+                }
+                return std::chrono::nanoseconds(upper_bound(HISTOGRAM_BUCKETS - 1));
+            }
+
+            const std::array<uint64_t, HISTOGRAM_BUCKETS>& buckets() const { return counts_; }
+
+        private:
+            static size_t leading_zeros(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+                return (size_t)__builtin_clzll(v);
+#else
+                size_t n = 0;
+                for (uint64_t bit = 1ull << 63; (v & bit) == 0; bit >>= 1) {
+                    ++n;
+                }
+                return n;
+#endif
+            }
+
+            std::array<uint64_t, HISTOGRAM_BUCKETS> counts_{};
+            uint64_t count_ = 0;
+            uint64_t sum_ = 0;
+        };
+
+        // the metrics of one method, merged from all the threads
+        struct method_metrics {
+            std::string name;
+            uint64_t calls = 0;
+            uint64_t errors = 0;
+            uint64_t request_bytes = 0;
+            uint64_t response_bytes = 0;
+            std::array<latency_histogram, METRIC_PHASES> latency;
+
+            const latency_histogram& phase(metric_phase p) const { return latency[(size_t)p]; }
+        };
+
+        inline const char* phase_name(metric_phase p) {
+            static const char* names[METRIC_PHASES] = { "queue", "decode", "handler", "encode", "total" };
+            return names[(size_t)p];
+        }
+
+        // one measured call, phases the call didn't go through are left at 0
+        struct call_sample {
+            std::array<std::chrono::steady_clock::duration, METRIC_PHASES> phases{};
+            size_t request_bytes = 0;
+            size_t response_bytes = 0;
+            bool failed = false;
+        };
+
+        /**
+         * Per-method call, error and byte counters and latency histograms. Each thread records into its
+         * own shard without locks or atomic read-modify-writes; snapshot() merges the shards.
+         */
+        class metrics : private asio::noncopyable {
+        public:
+            metrics() : id_(next_id()) {}
+
+            // the index to record calls of name with, npos once MAX_METRIC_METHODS are used
+            size_t add_method(const std::string& name) {
+                std::unique_lock<std::mutex> lock(mtx_);
+                for (size_t i = 0; i < names_.size(); ++i) {
+                    if (names_[i] == name) {
+                        return i;
+                    }
+                }
+
+                if (names_.size() == MAX_METRIC_METHODS) {
+                    return npos;
+                }
+
+                names_.push_back(name);
+                return names_.size() - 1;
+            }
+
+            void record(size_t method, const call_sample& sample) {
+                if (method >= MAX_METRIC_METHODS) {
+                    return;
+                }
+
+                auto& stats = local_shard().get(method);
+                increase(stats.calls, 1);
+                increase(stats.errors, sample.failed ? 1 : 0);
+                increase(stats.request_bytes, sample.request_bytes);
+                increase(stats.response_bytes, sample.response_bytes);
+                for (size_t i = 0; i < METRIC_PHASES; ++i) {
+                    auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(sample.phases[i]).count();
+                    if (ns > 0) {
+                        increase(stats.buckets[i][latency_histogram::bucket_of((uint64_t)ns)], 1);
+                        increase(stats.sum_ns[i], (uint64_t)ns);
+                    }
+                }
+            }
+
+            // methods which were called at least once
+            std::vector<method_metrics> snapshot() const {
+                std::vector<method_metrics> result;
+                std::unique_lock<std::mutex> lock(mtx_);
+                for (size_t m = 0; m < names_.size(); ++m) {
+                    method_metrics merged;
+                    merged.name = names_[m];
+                    for (auto& shard : shards_) {
+                        auto stats = shard.second->methods[m].load(std::memory_order_acquire);
+                        if (stats == nullptr) {
+                            continue;
+                        }
+
+                        merged.calls += stats->calls.load(std::memory_order_relaxed);
+                        merged.errors += stats->errors.load(std::memory_order_relaxed);
+                        merged.request_bytes += stats->request_bytes.load(std::memory_order_relaxed);
+                        merged.response_bytes += stats->response_bytes.load(std::memory_order_relaxed);
+                        for (size_t p = 0; p < METRIC_PHASES; ++p) {
+                            merged.latency[p].add_sum(stats->sum_ns[p].load(std::memory_order_relaxed));
+                            for (size_t b = 0; b < HISTOGRAM_BUCKETS; ++b) {
+                                auto n = stats->buckets[p][b].load(std::memory_order_relaxed);
+                                if (n != 0) {
+                                    merged.latency[p].add(b, n);
+                                }
+                            }
+                        }
+                    }
+
+                    if (merged.calls != 0) {
+                        result.push_back(std::move(merged));
+                    }
+                }
+                return result;
+            }
+
+            static const size_t npos = (size_t)-1;
+
+        private:
+            struct method_stats {
+                std::atomic<uint64_t> calls{ 0 };
+                std::atomic<uint64_t> errors{ 0 };
+                std::atomic<uint64_t> request_bytes{ 0 };
+                std::atomic<uint64_t> response_bytes{ 0 };
+                std::atomic<uint64_t> buckets[METRIC_PHASES][HISTOGRAM_BUCKETS];
+                std::atomic<uint64_t> sum_ns[METRIC_PHASES];
+
+                method_stats() {
+                    for (auto& sum : sum_ns) {
+                        sum.store(0, std::memory_order_relaxed);
+                    }
+                    for (auto& phase : buckets) {
+                        for (auto& bucket : phase) {
+                            bucket.store(0, std::memory_order_relaxed);
+                        }
+                    }
+                }
+            };
+
+            // written by its thread only, read by snapshot()
+            struct shard {
+                std::array<std::atomic<method_stats*>, MAX_METRIC_METHODS> methods;
+                std::vector<std::unique_ptr<method_stats>> owned;
+
+                shard() {
+                    for (auto& m : methods) {
+                        m.store(nullptr, std::memory_order_relaxed);
+                    }
+                }
+
+                method_stats& get(size_t method) {
+                    auto stats = methods[method].load(std::memory_order_relaxed);
+                    if (stats == nullptr) {
+                        owned.emplace_back(new method_stats());
+                        stats = owned.back().get();
+                        methods[method].store(stats, std::memory_order_release);
+                    }
+                    return *stats;
+                }
+            };
+
+            // single writer: a plain load and store, no locked instruction
+            static void increase(std::atomic<uint64_t>& counter, uint64_t n) {
+                counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+
+            shard& local_shard() {
+                struct cache {
+                    uint64_t owner = 0;
+                    shard* s = nullptr;
+                };
+                static thread_local cache local;
+                if (local.owner == id_) {
+                    return *local.s;
+                }
+
+                std::unique_lock<std::mutex> lock(mtx_);
+                auto& s = shards_[std::this_thread::get_id()];
+                if (s == nullptr) {
+                    s.reset(new shard());
+                }
+                local.owner = id_;
+                local.s = s.get();
+                return *s;
+            }
+
+            static uint64_t next_id() {
+                static std::atomic<uint64_t> id{ 0 };
+                return ++id;
+            }
+
+            const uint64_t id_;
+            mutable std::mutex mtx_;
+            std::vector<std::string> names_;
+            // shards outlive their thread, a thread id reused later gets the same shard back
+            std::unordered_map<std::thread::id, std::unique_ptr<shard>> shards_;
+        };
+    }  // namespace rpc_service
+}  // namespace rest_rpc
+
+#endif  // REST_RPC_METRICS_H_
@@ -0,0 +1,113 @@
+#ifndef REST_RPC_METRICS_HTTP_H_
+#define REST_RPC_METRICS_HTTP_H_
+
+#include <functional>
+#include <istream>
+#include <memory>
+#include <string>
+#include "use_asio.hpp"
+
+namespace rest_rpc {
+    namespace rpc_service {
+        static const size_t METRICS_HTTP_MAX_REQUEST = 8 * 1024;
+        static const size_t METRICS_HTTP_TIMEOUT_SECONDS = 5;
+
+        /**
+         * A minimal HTTP/1.0 listener for scrapers: GET /metrics is answered with what body()
+         * returns in the Prometheus text format, anything else with 404; the connection is closed
+         * after each response.
+         */
+        class metrics_http_server : private asio::noncopyable {
+        public:
+            metrics_http_server(boost::asio::io_service& ios, unsigned short port, std::function<std::string()> body)
+                : ios_(ios),
+                acceptor_(ios, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
+                body_(std::make_shared<std::function<std::string()>>(std::move(body))) {
+                do_accept();
+            }
+
+            ~metrics_http_server() {
+                boost::system::error_code ignored_ec;
+                acceptor_.close(ignored_ec);
+            }
+
+        private:
+            class session : public std::enable_shared_from_this<session> {
+            public:
+                session(boost::asio::io_service& ios, std::shared_ptr<std::function<std::string()>> body)
+                    : socket_(ios), timer_(ios), request_(METRICS_HTTP_MAX_REQUEST), body_(std::move(body)) {}
+
+                boost::asio::ip::tcp::socket& socket() { return socket_; }
+
+                void start() {
+                    auto self = shared_from_this();
+                    timer_.expires_from_now(std::chrono::seconds(METRICS_HTTP_TIMEOUT_SECONDS));
+                    timer_.async_wait([this, self](const boost::system::error_code& ec) {
+                        if (!ec) {
+                            close();
+                        }
+                    });
+
+                    boost::asio::async_read_until(socket_, request_, "\r\n\r\n",
+                        [this, self](const boost::system::error_code& ec, size_t) {
+                            if (ec) {
+                                close();
+                                return;
+                            }
+
+                            std::istream stream(&request_);
+                            std::string method, target;
+                            stream >> method >> target;
+                            respond(method == "GET" && (target == "/metrics" || target.compare(0, 9, "/metrics?") == 0));
+                        });
+                }
+
+            private:
+                void respond(bool found) {
+                    std::string body = found ? (*body_)() : "not found\n";
+                    response_ = found ? "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                                      : "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\n";
+                    response_ += "Content-Length: " + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+                    response_ += body;
+
+                    auto self = shared_from_this();
+                    boost::asio::async_write(socket_, boost::asio::buffer(response_),
+                        [this, self](const boost::system::error_code&, size_t) { close(); });
+                }
+
+                void close() {
+                    boost::system::error_code ignored_ec;
+                    timer_.cancel(ignored_ec);
+                    socket_.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored_ec);
+                    socket_.close(ignored_ec);
+                }
+
+                boost::asio::ip::tcp::socket socket_;
+                asio::steady_timer timer_;
+                boost::asio::streambuf request_;
+                std::string response_;
+                std::shared_ptr<std::function<std::string()>> body_;
+            };
+
+            void do_accept() {
+                auto conn = std::make_shared<session>(ios_, body_);
+                acceptor_.async_accept(conn->socket(), [this, conn](boost::system::error_code ec) {
+                    if (ec == boost::asio::error::operation_aborted) {
+                        return;
+                    }
+
+                    if (!ec) {
+                        conn->start();
+                    }
+                    do_accept();
+                });
+            }
+
+            boost::asio::io_service& ios_;
+            boost::asio::ip::tcp::acceptor acceptor_;
+            std::shared_ptr<std::function<std::string()>> body_;
+        };
+    }  // namespace rpc_service
+}  // namespace rest_rpc
+
+#endif  // REST_RPC_METRICS_HTTP_H_
@@ -1,10 +1,17 @@
 #ifndef REST_RPC_ROUTER_H_
 #define REST_RPC_ROUTER_H_
 
+#include <atomic>
 #include <functional>
+#include <unordered_set>
 #include "use_asio.hpp"
 #include "codec.h"
 #include "meta_util.hpp"
+#include "stream.h"
+#include "metrics.h"
+#include "trace.h"
+#include "frame.h"
+#include "slow_log.h"
 
 namespace rest_rpc {
     enum class ExecMode { sync, async };
@@ -25,7 +32,62 @@ namespace rest_rpc {
                 return register_member_func<model>(name, f, self);
             }
 
-            void remove_handler(std::string const& name) { this->map_invokers_.erase(name); }
+            // f(rpc_conn conn, stream_ptr stream, Args... args): args come with the stream_open
+            // frame, then the handler reads and writes chunks through the stream.
+            template<typename Function>
+            void register_stream_handler(std::string const& name, Function f) {
+                this->map_stream_invokers_[name] = { std::bind(&stream_invoker<Function>::apply, std::move(f),
+                                                              std::placeholders::_1, std::placeholders::_2,
+                                                              std::placeholders::_3, std::placeholders::_4,
+                                                              std::placeholders::_5) };
+            }
+
+            std::vector<std::string> handler_names() const {
+                std::vector<std::string> names;
+                for (auto& invoker : map_invokers_) {
+                    names.push_back(invoker.first);
+                }
+                for (auto& invoker : map_stream_invokers_) {
+                    names.push_back(invoker.first);
+                }
+                return names;
+            }
+
+            void remove_handler(std::string const& name) {
+                this->map_invokers_.erase(name);
+                this->async_funcs_.erase(name);
+                this->map_stream_invokers_.erase(name);
+            }
+
+            // when set, requests are executed by the executor instead of inline on the io thread
+            void set_executor(std::function<void(std::function<void()>)> executor) {
+                executor_ = std::move(executor);
+            }
+
+            bool has_executor() const { return executor_ != nullptr; }
+
+            // runs the stream handlers, which block for their whole transfer; without it streams
+            // are refused
+            void set_stream_executor(std::function<void(std::function<void()>)> executor) {
+                stream_executor_ = std::move(executor);
+            }
+
+            void execute(std::function<void()> task) {
+                executor_(std::move(task));
+            }
+
+            // per-method counters and latencies of the calls, on by default
+            void enable_metrics(bool enable) { metrics_enabled_ = enable; }
+
+            std::vector<method_metrics> get_metrics() const { return metrics_.snapshot(); }
+
+            slow_request_log& slow_log() { return slow_log_; }
+
+            // requests dropped because their deadline passed before they ran
+            uint64_t expired_requests() const { return expired_; }
+
+            // requests dropped because the client cancelled them before they ran
+            uint64_t cancelled_requests() const { return cancelled_; }
 
             template<typename T>
             void route(const char* data, std::size_t size, std::weak_ptr<T> conn) {
@@ -35,40 +97,290 @@ namespace rest_rpc {
                 }
 
                 auto req_id = conn_sp->request_id();
+                const bool oneway = conn_sp->is_oneway();
                 std::string result;
+                if (!oneway && conn_sp->cancelled()) {
+                    // cancelled while it was queued, nobody reads the response
+                    cancelled_++;
+                    conn_sp->finish_request(req_id);
+                    return;
+                }
+
+                if (conn_sp->deadline_exceeded()) {
+                    // the client gave up while the request was queued, don't decode nor run it
+                    expired_++;
+                    if (!oneway) {
+                        conn_sp->response(req_id, msgpack_codec::pack_args_str(result_code::FAIL, "deadline exceeded"));
+                    }
+                    return;
+                }
+
                 try {
                     msgpack_codec codec;
                     auto p = codec.unpack<std::tuple<std::string>>(data, size);
                     auto& func_name = std::get<0>(p);
+                    if (func_name == BATCH_RPC_NAME) {
+                        route_batch(data, size, conn, result);
+                        if (!oneway) {
+                            check_result_size(result, conn_sp->max_frame_size(), func_name);
+                            conn_sp->response(req_id, std::move(result));
+                        }
+                        return;
+                    }
+
                     auto it = map_invokers_.find(func_name);
                     if (it == map_invokers_.end()) {
-                        result = codec.pack_args_str(result_code::FAIL, "unknown function: " + func_name);
-                        conn_sp->response(req_id, std::move(result));
+                        if (!oneway) {
+                            result = codec.pack_args_str(result_code::FAIL, "unknown function: " + func_name);
+                            conn_sp->response(req_id, std::move(result));
+                        }
                         return;
                     }
 
                     ExecMode model;
-                    it->second(conn, data, size, result, model);
-                    if (model == ExecMode::sync) {
-                        if (result.size() >= MAX_BUF_LEN) {
-                            result = codec.pack_args_str(result_code::FAIL, "the response result is out of range: more than 10M " + func_name);
-                        }
+                    skip_result() = oneway;
+                    invoke(it->second, conn, data, size, result, model, conn_sp->frame());
+                    skip_result() = false;
+                    if (model == ExecMode::sync && slow_log_.enabled()) {
+                        check_slow(func_name, conn_sp, data, size, result.size());
+                    }
+                    if (model == ExecMode::sync && !oneway) {
+                        check_result_size(result, conn_sp->max_frame_size(), func_name);
                         conn_sp->response(req_id, std::move(result));
                     }
                 }
                 catch (const std::exception & ex) {
+                    skip_result() = false;
+                    if (oneway) {
+                        return;
+                    }
+
                     msgpack_codec codec;
                     result = codec.pack_args_str(result_code::FAIL, ex.what());
                     conn_sp->response(req_id, std::move(result));
                 }
             }
 
+            // stream handlers block on their reader and writer for the whole transfer, so they
+            // run on the stream executor. Its side is finished when it returns.
+            template<typename T>
+            void route_stream(const char* data, std::size_t size, std::weak_ptr<T> conn, stream_ptr stream) {
+                if (!stream_executor_) {
+                    stream->finish(result_code::FAIL, "streams are not enabled");
+                    return;
+                }
+
+                std::function<void()> task;
+                try {
+                    msgpack_codec codec;
+                    auto p = codec.unpack<std::tuple<std::string>>(data, size);
+                    auto& func_name = std::get<0>(p);
+                    auto it = map_stream_invokers_.find(func_name);
+                    if (it == map_stream_invokers_.end()) {
+                        stream->finish(result_code::FAIL, "unknown stream function: " + func_name);
+                        return;
+                    }
+
+                    it->second(conn, data, size, stream, task);
+                }
+                catch (const std::exception & ex) {
+                    stream->finish(result_code::FAIL, ex.what());
+                    return;
+                }
+
+                stream_executor_([task, stream] {
+                    try {
+                        task();
+                        stream->finish();
+                    }
+                    catch (const std::exception & ex) {
+                        stream->finish(result_code::FAIL, ex.what());
+                    }
+                });
+            }
+
             router() = default;
 
         private:
             router(const router&) = delete;
             router(router&&) = delete;
 
+            // the body is (BATCH_RPC_NAME, [call...]), each call packed as a normal request body,
+            // the result is an array with the packed result of each call in the same order.
+            void route_batch(const char* data, std::size_t size, std::weak_ptr<connection> conn, std::string& result) {
+                msgpack_codec codec;
+                auto tp = codec.unpack<std::tuple<std::string, std::vector<std::string>>>(data, size);
+                auto& calls = std::get<1>(tp);
+
+                std::vector<std::string> results;
+                results.reserve(calls.size());
+                for (auto& call : calls) {
+                    std::string call_result;
+                    try {
+                        auto p = codec.unpack<std::tuple<std::string>>(call.data(), call.size());
+                        auto& func_name = std::get<0>(p);
+                        auto it = map_invokers_.find(func_name);
+                        if (it == map_invokers_.end()) {
+                            call_result = codec.pack_args_str(result_code::FAIL, "unknown function: " + func_name);
+                        }
+                        else if (async_funcs_.count(func_name)) {
+                            call_result = codec.pack_args_str(result_code::FAIL, "async function can't be batched: " + func_name);
+                        }
+                        else {
+                            ExecMode model;
+                            invoke(it->second, conn, call.data(), call.size(), call_result, model, frame_header{});
+                        }
+                    }
+                    catch (const std::exception & ex) {
+                        call_result = codec.pack_args_str(result_code::FAIL, ex.what());
+                    }
+                    results.push_back(std::move(call_result));
+                }
+
+                result = codec.pack_args_str(result_code::OK, results);
+            }
+
+            // set while a oneway call runs, its result is never packed
+            static bool& skip_result() {
+                static thread_local bool skip = false;
+                return skip;
+            }
+
+            // when the call being invoked on this thread finished decoding and its handler,
+            // only taken while measuring
+            struct call_timing {
+                bool active;
+                bool failed;
+                std::chrono::steady_clock::time_point decoded;
+                std::chrono::steady_clock::time_point handled;
+                std::chrono::steady_clock::time_point start;  // of invoke, unset if it wasn't measured
+                std::chrono::steady_clock::time_point end;
+            };
+
+            static call_timing& timing() {
+                static thread_local call_timing t{};
+                return t;
+            }
+
+            static void mark(std::chrono::steady_clock::time_point& point) {
+                if (timing().active) {
+                    point = std::chrono::steady_clock::now();
+                }
+            }
+
+            struct invoker_entry;
+
+            // frame is the request's header, queue wait isn't measured if its received time is unset
+            void invoke(const invoker_entry& entry, std::weak_ptr<connection> conn, const char* data, size_t size,
+                std::string& result, ExecMode& model, const frame_header& frame) {
+                const bool measured = metrics_enabled_ && entry.metric_id != metrics::npos;
+                const bool traced = frame.trace_id != 0;
+                using clock = std::chrono::steady_clock;
+                auto& t = timing();
+                if (!measured && !traced && !slow_log_.enabled()) {
+                    t.start = clock::time_point{};
+                    entry.invoke(conn, data, size, result, model);
+                    return;
+                }
+
+                t = call_timing{ true, false, clock::time_point{}, clock::time_point{}, clock::time_point{}, clock::time_point{} };
+                if (traced) {
+                    current_trace() = trace_context{ frame.trace_id, frame.span_id };
+                }
+                auto start = clock::now();
+                entry.invoke(conn, data, size, result, model);
+                auto end = clock::now();
+                t.active = false;
+                t.start = start;
+                t.end = end;
+                if (traced) {
+                    current_trace() = trace_context{};
+                    trace_call(frame, start, end);
+                }
+                if (!measured) {
+                    return;
+                }
+
+                auto received = frame.received;
+
+                call_sample sample;
+                auto phase = [&sample](metric_phase p) -> clock::duration& { return sample.phases[(size_t)p]; };
+                if (received != clock::time_point{}) {
+                    phase(metric_phase::queue) = start - received;
+                    phase(metric_phase::total) = end - received;
+                }
+                else {
+                    phase(metric_phase::total) = end - start;
+                }
+                if (t.decoded != clock::time_point{}) {
+                    phase(metric_phase::decode) = t.decoded - start;
+                    if (t.handled != clock::time_point{}) {
+                        phase(metric_phase::handler) = t.handled - t.decoded;
+                        phase(metric_phase::encode) = end - t.handled;
+                    }
+                }
+                sample.request_bytes = size;
+                sample.response_bytes = result.size();
+                sample.failed = t.failed;
+                metrics_.record(entry.metric_id, sample);
+            }
+
+            static void trace_call(const frame_header& frame, std::chrono::steady_clock::time_point start,
+                std::chrono::steady_clock::time_point end) {
+                auto& tr = get_tracer();
+                auto& t = timing();
+                trace_context context{ frame.trace_id, frame.span_id };
+                if (frame.received != std::chrono::steady_clock::time_point{}) {
+                    tr.record(span_kind::enqueue, context, tracer::new_id(), frame.method_id, frame.received, start);
+                }
+                if (t.decoded != std::chrono::steady_clock::time_point{}) {
+                    tr.record(span_kind::decode, context, tracer::new_id(), frame.method_id, start, t.decoded);
+                    if (t.handled != std::chrono::steady_clock::time_point{}) {
+                        tr.record(span_kind::handler, context, tracer::new_id(), frame.method_id, t.decoded, t.handled);
+                        tr.record(span_kind::encode, context, tracer::new_id(), frame.method_id, t.handled, end);
+                    }
+                }
+            }
+
+            // report the call just invoked if it reached its method's threshold
+            template<typename T>
+            void check_slow(const std::string& name, const std::shared_ptr<T>& conn, const char* data, size_t size,
+                size_t response_bytes) {
+                using clock = std::chrono::steady_clock;
+                auto threshold = slow_log_.threshold(name);
+                auto& t = timing();
+                if (threshold.count() == 0 || t.start == clock::time_point{}) {
+                    return;
+                }
+
+                auto received = conn->received_time();
+                auto queue = received == clock::time_point{} ? clock::duration::zero() : t.start - received;
+                auto total = t.end - t.start + queue;
+                auto handler = (t.decoded != clock::time_point{} && t.handled != clock::time_point{}) ?
+                    t.handled - t.decoded : clock::duration::zero();
+                if ((total < threshold && handler < threshold) || !slow_log_.admit()) {
+                    return;
+                }
+
+                std::string address;
+                try {
+                    address = conn->remote_address();
+                }
+                catch (const std::exception&) {
+                    // the client is gone
+                }
+
+                slow_log_.log(slow_request{ name, conn->conn_id(), std::move(address), size, response_bytes, queue, handler, total,
+                    slow_log_.max_args_bytes() == 0 ? std::string() : msgpack_codec::to_text(data, size, slow_log_.max_args_bytes()) });
+            }
+
+            static void check_result_size(std::string& result, size_t max_frame_size, const std::string& func_name) {
+                if (result.size() >= max_frame_size) {
+                    result = msgpack_codec::pack_args_str(result_code::FAIL, "the response result is out of range: more than "
+                        + std::to_string(max_frame_size) + " bytes " + func_name);
+                }
+            }
+
             template<typename F, size_t... I, typename Arg, typename... Args>
             static typename std::result_of<F(std::weak_ptr<connection>, Args...)>::type call_helper(
                 const F & f, const std::index_sequence<I...>&, std::tuple<Arg, Args...> tup, std::weak_ptr<connection> ptr) {
@@ -80,7 +392,10 @@ namespace rest_rpc {
                 typename std::enable_if<std::is_void<typename std::result_of<F(std::weak_ptr<connection>, Args...)>::type>::value>::type
                 call(const F & f, std::weak_ptr<connection> ptr, std::string & result, std::tuple<Arg, Args...> tp) {
                 call_helper(f, std::make_index_sequence<sizeof...(Args)>{}, std::move(tp), ptr);
-                result = msgpack_codec::pack_args_str(result_code::OK);
+                mark(timing().handled);
+                if (!skip_result()) {
+                    result = msgpack_codec::pack_args_str(result_code::OK);
+                }
             }
 
             template<typename F, typename Arg, typename... Args>
@@ -88,8 +403,10 @@ namespace rest_rpc {
                 typename std::enable_if<!std::is_void<typename std::result_of<F(std::weak_ptr<connection>, Args...)>::type>::value>::type
                 call(const F & f, std::weak_ptr<connection> ptr, std::string & result, std::tuple<Arg, Args...> tp) {
                 auto r = call_helper(f, std::make_index_sequence<sizeof...(Args)>{}, std::move(tp), ptr);
-                msgpack_codec codec;
-                result = msgpack_codec::pack_args_str(result_code::OK, r);
+                mark(timing().handled);
+                if (!skip_result()) {
+                    result = msgpack_codec::pack_args_str(result_code::OK, r);
+                }
             }
 
             template<typename F, typename Self, size_t... Indexes, typename Arg, typename... Args>
@@ -105,7 +422,10 @@ namespace rest_rpc {
                 call_member(const F & f, Self * self, std::weak_ptr<connection> ptr, std::string & result,
                     std::tuple<Arg, Args...> tp) {
                 call_member_helper(f, self, typename std::make_index_sequence<sizeof...(Args)>{}, std::move(tp), ptr);
-                result = msgpack_codec::pack_args_str(result_code::OK);
+                mark(timing().handled);
+                if (!skip_result()) {
+                    result = msgpack_codec::pack_args_str(result_code::OK);
+                }
             }
 
             template<typename F, typename Self, typename Arg, typename... Args>
@@ -115,7 +435,10 @@ namespace rest_rpc {
                     std::tuple<Arg, Args...> tp) {
                 auto r =
                     call_member_helper(f, self, typename std::make_index_sequence<sizeof...(Args)>{}, std::move(tp), ptr);
-                result = msgpack_codec::pack_args_str(result_code::OK, r);
+                mark(timing().handled);
+                if (!skip_result()) {
+                    result = msgpack_codec::pack_args_str(result_code::OK, r);
+                }
             }
 
             template<typename Function, ExecMode mode = ExecMode::sync>
@@ -128,13 +451,16 @@ namespace rest_rpc {
                     msgpack_codec codec;
                     try {
                         auto tp = codec.unpack<args_tuple>(data, size);
+                        mark(timing().decoded);
                         call(func, conn, result, std::move(tp));
                         exe_model = model;
                     }
                     catch (std::invalid_argument & e) {
+                        timing().failed = true;
                         result = codec.pack_args_str(result_code::FAIL, e.what());
                     }
                     catch (const std::exception & e) {
+                        timing().failed = true;
                         result = codec.pack_args_str(result_code::FAIL, e.what());
                     }
                 }
@@ -148,23 +474,57 @@ namespace rest_rpc {
                     msgpack_codec codec;
                     try {
                         auto tp = codec.unpack<args_tuple>(data, size);
+                        mark(timing().decoded);
                         call_member(func, self, conn, result, std::move(tp));
                         exe_model = model;
                     }
                     catch (std::invalid_argument & e) {
+                        timing().failed = true;
                         result = codec.pack_args_str(result_code::FAIL, e.what());
                     }
                     catch (const std::exception & e) {
+                        timing().failed = true;
                         result = codec.pack_args_str(result_code::FAIL, e.what());
                     }
                 }
             };
 
+            template<typename T>
+            struct stream_args;
+
+            template<typename Ret, typename Conn, typename Stream, typename... Args>
+            struct stream_args<Ret(Conn, Stream, Args...)> {
+                using type = std::tuple<std::string, remove_const_reference_t<Args>...>;
+            };
+
+            template<typename Function>
+            struct stream_invoker {
+                using args_tuple = typename stream_args<typename function_traits<Function>::function_type>::type;
+
+                // unpack now, the frame buffer is reused by the next read
+                static inline void apply(const Function& func, std::weak_ptr<connection> conn, const char* data, size_t size,
+                    stream_ptr stream, std::function<void()>& task) {
+                    msgpack_codec codec;
+                    auto tp = std::make_shared<args_tuple>(codec.unpack<args_tuple>(data, size));
+                    task = [func, conn, stream, tp] {
+                        call_stream(func, conn, stream, std::make_index_sequence<std::tuple_size<args_tuple>::value - 1>{}, *tp);
+                    };
+                }
+
+                template<size_t... I>
+                static void call_stream(const Function& func, std::weak_ptr<connection> conn, stream_ptr stream,
+                    const std::index_sequence<I...>&, args_tuple& tp) {
+                    func(conn, stream, std::move(std::get<I + 1>(tp))...);
+                }
+            };
+
             template<ExecMode model, typename Function>
             void register_nonmember_func(std::string const& name, Function f) {
                 this->map_invokers_[name] = { std::bind(&invoker<Function>::template apply<model>, std::move(f), std::placeholders::_1,
                                                        std::placeholders::_2, std::placeholders::_3,
-                                                       std::placeholders::_4, std::placeholders::_5) };
+                                                       std::placeholders::_4, std::placeholders::_5),
+                                              metrics_.add_method(name) };
+                set_exec_mode<model>(name);
             }
 
             template<ExecMode model, typename Function, typename Self>
@@ -172,12 +532,38 @@ namespace rest_rpc {
                 this->map_invokers_[name] = { std::bind(&invoker<Function>::template apply_member<model, Self>,
                                                        f, self, std::placeholders::_1, std::placeholders::_2,
                                                        std::placeholders::_3, std::placeholders::_4,
-                                                       std::placeholders::_5) };
+                                                       std::placeholders::_5),
+                                              metrics_.add_method(name) };
+                set_exec_mode<model>(name);
+            }
+
+            template<ExecMode model>
+            void set_exec_mode(const std::string& name) {
+                if (model == ExecMode::async) {
+                    async_funcs_.insert(name);
+                }
+                else {
+                    async_funcs_.erase(name);
+                }
             }
 
+            struct invoker_entry {
+                std::function<void(std::weak_ptr<connection>, const char*, size_t, std::string&, ExecMode& model)> invoke;
+                size_t metric_id;
+            };
+
+            std::unordered_map<std::string, invoker_entry> map_invokers_;
+            std::unordered_set<std::string> async_funcs_;
             std::unordered_map<std::string,
-                std::function<void(std::weak_ptr<connection>, const char*, size_t, std::string&, ExecMode& model)>>
-                map_invokers_;
+                std::function<void(std::weak_ptr<connection>, const char*, size_t, stream_ptr, std::function<void()>&)>>
+                map_stream_invokers_;
+            std::function<void(std::function<void()>)> executor_;
+            std::function<void(std::function<void()>)> stream_executor_;
+            std::atomic<uint64_t> expired_ = { 0 };
+            std::atomic<uint64_t> cancelled_ = { 0 };
+            metrics metrics_;
+            std::atomic<bool> metrics_enabled_ = { true };
+            slow_request_log slow_log_;
         };
     }  // namespace rpc_service
 }  // namespace rest_rpc
@@ -5,9 +5,14 @@
 #include <future>
 #include <utility>
 #include "use_asio.hpp"
+#include "io_service_pool.h"
 #include "client_util.hpp"
 #include "const_vars.h"
 #include "meta_util.hpp"
+#include "stream.h"
+#include "compress.h"
+#include "frame.h"
+#include "trace.h"
 #include <functional>
 
 using namespace rest_rpc::rpc_service;
@@ -28,6 +33,12 @@ public:
   req_result(string_view data) : data_(data.data(), data.length()) {}
   bool success() const { return !has_error(data_); }
 
+  // rejected by the server's admission control without being run, retry later or elsewhere
+  bool overloaded() const {
+    return !data_.empty() &&
+           get_result_code(data_) == (int)result_code::OVERLOADED;
+  }
+
   template <typename T> T as() {
     if (has_error(data_)) {
       throw std::logic_error(get_error_msg(data_));
@@ -47,25 +58,49 @@ private:
 };
 
 enum class CallModel { future, callback };
+
+/**
+ * What a call does when the client's in-flight limits are reached, see
+ * rpc_client::set_max_inflight.
+ */
+enum class overflow_policy {
+  block, // wait up to the configured time for a response or a write to make room
+  fail,  // fail the call at once
+};
 const constexpr auto FUTURE = CallModel::future;
 
 const constexpr size_t DEFAULT_TIMEOUT = 5000; // milliseconds
 
 class rpc_client : private asio::noncopyable {
 public:
-  rpc_client()
-      : socket_(ios_), work_(ios_), deadline_(ios_), body_(INIT_BUF_SIZE) {
-    thd_ = std::make_shared<std::thread>([this] { ios_.run(); });
-  }
+  rpc_client() : rpc_client(nullptr, "", 0) {}
+
+  /**
+   * Run on an io_service owned by the caller instead of a dedicated thread,
+   * so that many clients can share a few event loops. The io_service must
+   * outlive the client.
+   */
+  explicit rpc_client(boost::asio::io_service &ios) : rpc_client(&ios, "", 0) {}
+
+  rpc_client(boost::asio::io_service &ios, std::string host,
+             unsigned short port)
+      : rpc_client(&ios, std::move(host), port) {}
+
+  /**
+   * Share one of the event loops of an io_service_pool, e.g. the one of an
+   * rpc_server in the same process.
+   */
+  explicit rpc_client(io_service_pool &pool)
+      : rpc_client(pool.get_io_service()) {}
+
+  rpc_client(io_service_pool &pool, std::string host, unsigned short port)
+      : rpc_client(pool.get_io_service(), std::move(host), port) {}
 
   rpc_client(client_language_t client_language,
              std::function<void(long, const std::string &)>
                  on_result_received_callback)
-      : socket_(ios_), work_(ios_), deadline_(ios_), body_(INIT_BUF_SIZE),
-        client_language_(client_language),
-        on_result_received_callback_(std::move(on_result_received_callback)) {
-    thd_ = std::make_shared<std::thread>([this] { ios_.run(); });
-  }
+      : rpc_client(nullptr, "", 0, client_language,
+                   std::move(on_result_received_callback)) {}
 
   rpc_client(const std::string &host, unsigned short port)
       : rpc_client(client_language_t::CPP, nullptr, host, port) {}
@@ -74,13 +109,16 @@ public:
              std::function<void(long, const std::string &)>
                  on_result_received_callback,
              std::string host, unsigned short port)
-      : socket_(ios_), work_(ios_), deadline_(ios_), host_(std::move(host)),
-        port_(port), body_(INIT_BUF_SIZE), client_language_(client_language),
-        on_result_received_callback_(std::move(on_result_received_callback)) {
-    thd_ = std::make_shared<std::thread>([this] { ios_.run(); });
-  }
+      : rpc_client(nullptr, std::move(host), port, client_language,
+                   std::move(on_result_received_callback)) {}
 
   ~rpc_client() {
+    enable_reconnect_ = false;
+    // handlers running on a shared io_service must be done with socket_ and
+    // the maps before we touch them, the ones still queued are skipped
+    wait_handlers();
+    deadline_.cancel();
+    reconnect_timer_.cancel();
     close();
     stop();
   }
@@ -99,6 +137,50 @@ public:
     reconnect_cnt_ = reconnect_count;
   }
 
+  /**
+   * Largest frame in bytes this client sends or accepts, set it before connecting.
+   * The server answers with the smaller of both limits, see max_frame_size().
+   */
+  void set_max_frame_size(size_t bytes) {
+    local_max_frame_size_ = (std::min)(bytes, MAX_FRAME_LIMIT);
+    max_frame_size_ = local_max_frame_size_;
+  }
+
+  size_t max_frame_size() const { return max_frame_size_; }
+
+  /**
+   * Offer a codec when connecting, requests and responses of at least threshold
+   * bytes are then compressed if the server accepts it, see compression().
+   */
+  void set_compression(compress_type type,
+                       size_t threshold = COMPRESS_THRESHOLD) {
+    offered_compression_ = type;
+    compress_threshold_ = threshold;
+  }
+
+  compress_type compression() const { return compression_; }
+
+  /**
+   * Bound the requests waiting for a response and the bytes queued for
+   * writing, 0 means unlimited. A call over a limit waits up to wait_ms for
+   * room with overflow_policy::block, it fails at once with
+   * overflow_policy::fail or when made from the client's io thread. Failed
+   * calls get a "too many requests in flight" error, no_buffer_space for
+   * callbacks, and call_oneway returns false.
+   */
+  void set_max_inflight(size_t requests, size_t bytes,
+                        overflow_policy policy = overflow_policy::block,
+                        size_t wait_ms = DEFAULT_TIMEOUT) {
+    std::lock_guard<std::mutex> lock(room_mtx_);
+    max_inflight_ = requests;
+    max_outbox_bytes_ = bytes;
+    overflow_policy_ = policy;
+    overflow_wait_ms_ = wait_ms;
+  }
+
+  // bytes of requests queued and not written yet
+  size_t outbox_bytes() const { return outbox_bytes_; }
+
   bool connect(size_t timeout = 3, bool is_ssl = false) {
     if (has_connected_) {
       return true;
@@ -173,6 +255,7 @@ public:
 #endif
     }
 
+    abort_streams();
     if (!has_connected_) {
       return;
     } else {
@@ -191,12 +274,15 @@ public:
 
   bool has_connected() const { return has_connected_; }
 
+  // requests sent but not answered yet
+  size_t outstanding() const { return outstanding_; }
+
   // sync call
 #if __cplusplus > 201402L
   template <size_t TIMEOUT, typename T = void, typename... Args>
   auto call(const std::string &rpc_name, Args &&... args) {
     std::future<req_result> future =
-        async_call<FUTURE>(rpc_name, std::forward<Args>(args)...);
+        async_call_with_deadline(TIMEOUT, rpc_name, std::forward<Args>(args)...);
     auto status = future.wait_for(std::chrono::milliseconds(TIMEOUT));
     if (status == std::future_status::timeout ||
         status == std::future_status::deferred) {
@@ -219,7 +305,7 @@ public:
   typename std::enable_if<std::is_void<T>::value>::type
   call(const std::string &rpc_name, Args &&... args) {
     std::future<req_result> future =
-        async_call<FUTURE>(rpc_name, std::forward<Args>(args)...);
+        async_call_with_deadline(TIMEOUT, rpc_name, std::forward<Args>(args)...);
     auto status = future.wait_for(std::chrono::milliseconds(TIMEOUT));
     if (status == std::future_status::timeout ||
         status == std::future_status::deferred) {
@@ -239,7 +325,7 @@ public:
   typename std::enable_if<!std::is_void<T>::value, T>::type
   call(const std::string &rpc_name, Args &&... args) {
     std::future<req_result> future =
-        async_call<FUTURE>(rpc_name, std::forward<Args>(args)...);
+        async_call_with_deadline(TIMEOUT, rpc_name, std::forward<Args>(args)...);
     auto status = future.wait_for(std::chrono::milliseconds(TIMEOUT));
     if (status == std::future_status::timeout ||
         status == std::future_status::deferred) {
@@ -258,9 +344,43 @@ public:
 
   template <CallModel model, typename... Args>
   std::future<req_result> async_call(const std::string &rpc_name, Args &&... args) {
+    return async_call_with_deadline(0, rpc_name, std::forward<Args>(args)...);
+  }
+
+  /**
+   * timeout_ms, if not 0, is sent to the server as the request's deadline,
+   * it drops the request instead of running it once the deadline passed.
+   */
+  template <typename... Args>
+  std::future<req_result> async_call_with_deadline(size_t timeout_ms, const std::string &rpc_name,
+                                    Args &&... args) {
+    uint64_t req_id = 0;
+    return async_call_cancellable(req_id, timeout_ms, rpc_name,
+                                  std::forward<Args>(args)...);
+  }
+
+  /**
+   * Like async_call_with_deadline, req_id receives the id to pass to cancel().
+   */
+  template <typename... Args>
+  std::future<req_result> async_call_cancellable(uint64_t &req_id, size_t timeout_ms,
+                                                 const std::string &rpc_name,
+                                                 Args &&... args) {
     auto p = std::make_shared<std::promise<req_result>>();
     std::future<req_result> future = p->get_future();
 
+    msgpack_codec codec;
+    auto ret = codec.pack_args(rpc_name, std::forward<Args>(args)...);
+    if (ret.size() >= max_frame_size_) {
+      p->set_value(req_result(out_of_range_result()));
+      return future;
+    }
+
+    if (!reserve_room(ret.size(), true)) {
+      p->set_value(req_result(no_room_result()));
+      return future;
+    }
+
     uint64_t fu_id = 0;
     {
       std::lock_guard<std::mutex> lock(cb_mtx_);
@@ -270,10 +390,150 @@ public:
       assert(status.second);
     }
 
+    req_id = fu_id;
+    write(fu_id, request_type::req_res, std::move(ret),
+          method_id(rpc_name.data(), rpc_name.size()), timeout_ms);
+    return future;
+  }
+
+  /**
+   * Give up on a request of async_call_cancellable or of the callback
+   * async_call: its future gets a "request cancelled" error, its callback
+   * operation_aborted, and the server is told to skip it or drop its response.
+   * Returns false if it already completed.
+   */
+  bool cancel(uint64_t req_id) {
+    std::shared_ptr<call_t> call;
+    {
+      std::lock_guard<std::mutex> lock(cb_mtx_);
+      if (req_id >> 63) {
+        auto it = callback_map_.find(req_id);
+        if (it == callback_map_.end()) {
+          return false;
+        }
+        call = std::move(it->second);
+        callback_map_.erase(it);
+      } else {
+        auto it = future_map_.find(req_id);
+        if (it == future_map_.end()) {
+          return false;
+        }
+        it->second->set_value(req_result(msgpack_codec::pack_args_str(
+            result_code::FAIL, "request cancelled")));
+        future_map_.erase(it);
+      }
+      end_trace(req_id);
+      outstanding_--;
+    }
+    notify_room();
+
+    if (call) {
+      call->cancel();
+      call->callback(asio::error::make_error_code(asio::error::operation_aborted), {});
+    }
+
+    if (has_connected_) {
+      // a server without cancellation reads it as a heartbeat
+      write(req_id, request_type::cancel, buffer_type(0));
+    }
+    return true;
+  }
+
+  /**
+   * Several calls sent as one frame and executed by the server in order,
+   * each result keeps its own error code:
+   *   auto results = client.batch().add("get", 1).add("get", 2).call();
+   * Async handlers can't be batched.
+   */
+  class batch_t {
+  public:
+    explicit batch_t(rpc_client &client) : client_(client) {}
+
+    template <typename... Args>
+    batch_t &add(const std::string &rpc_name, Args &&... args) {
+      auto buf = msgpack_codec::pack_args(rpc_name, std::forward<Args>(args)...);
+      calls_.emplace_back(buf.data(), buf.size());
+      return *this;
+    }
+
+    size_t size() const { return calls_.size(); }
+
+    std::future<req_result> async_call() {
+      return client_.async_call<FUTURE>(BATCH_RPC_NAME, calls_);
+    }
+
+    template <size_t TIMEOUT = DEFAULT_TIMEOUT>
+    std::vector<req_result> call() {
+      std::future<req_result> future =
+          client_.async_call_with_deadline(TIMEOUT, BATCH_RPC_NAME, calls_);
+      auto status = future.wait_for(std::chrono::milliseconds(TIMEOUT));
+      if (status == std::future_status::timeout ||
+          status == std::future_status::deferred) {
+        throw std::out_of_range("timeout or deferred");
+      }
+
+      auto packed = future.get().as<std::vector<std::string>>();
+      std::vector<req_result> results;
+      results.reserve(packed.size());
+      for (auto &result : packed) {
+        results.emplace_back(result);
+      }
+      return results;
+    }
+
+  private:
+    rpc_client &client_;
+    std::vector<std::string> calls_;
+  };
+
+  batch_t batch() { return batch_t(*this); }
+
+  /**
+   * Open a streaming rpc, args go to the handler registered with
+   * register_stream_handler. Write chunks and finish() the stream once done
+   * writing, read() returns false after the server finished its side.
+   * The stream blocks, don't use it on the io thread.
+   */
+  template <typename... Args>
+  stream_ptr open_stream(const std::string &rpc_name, Args &&... args) {
+    uint64_t stream_id = 0;
+    {
+      std::lock_guard<std::mutex> lock(streams_mtx_);
+      stream_id = ++stream_id_;
+    }
+
+    // the stream may outlive the client, guarded its calls become no-ops then
+    auto stream = std::make_shared<rpc_stream>(
+        stream_id, guard([this, stream_id](request_type type, std::string frame) {
+          buffer_type buffer(frame.size());
+          buffer.write(frame.data(), frame.size());
+          write(stream_id, type, std::move(buffer));
+        }));
+    stream->set_max_chunk_size(max_frame_size_ - 1);
+    stream->set_done_callback(guard([this, stream_id] {
+      std::lock_guard<std::mutex> lock(streams_mtx_);
+      streams_.erase(stream_id);
+    }));
+
+    if (!has_connected_) {
+      stream->abort("not connected");
+      return stream;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(streams_mtx_);
+      streams_.emplace(stream_id, stream);
+    }
+
     msgpack_codec codec;
     auto ret = codec.pack_args(rpc_name, std::forward<Args>(args)...);
-    write(fu_id, request_type::req_res, std::move(ret));
-    return future;
+    if (ret.size() >= max_frame_size_) {
+      stream->abort(get_error_msg(out_of_range_result()));
+      return stream;
+    }
+
+    write(stream_id, request_type::stream_open, std::move(ret));
+    return stream;
   }
 
   /**
@@ -289,6 +549,14 @@ public:
       fu_id = fu_id_;
     }
 
+    if (encoded_func_name_and_args.size() >= max_frame_size_) {
+      // fails like a response would, the id is answered exactly once
+      if (on_result_received_callback_) {
+        on_result_received_callback_(fu_id, out_of_range_result());
+      }
+      return fu_id;
+    }
+
     msgpack::sbuffer sbuffer;
     sbuffer.write(encoded_func_name_and_args.data(),
                   encoded_func_name_and_args.size());
@@ -296,16 +564,56 @@ public:
     return fu_id;
   }
 
+  /**
+   * Returns the request id to pass to cancel(), 0 if nothing was sent.
+   */
   template <size_t TIMEOUT = DEFAULT_TIMEOUT, typename... Args>
-  void async_call(const std::string &rpc_name,
-                  std::function<void(boost::system::error_code, string_view)> cb,
-                  Args &&... args) {
+  uint64_t async_call(const std::string &rpc_name,
+                      std::function<void(boost::system::error_code, string_view)> cb,
+                      Args &&... args) {
     if (!has_connected_) {
       if (cb) {
         cb(boost::asio::error::make_error_code(boost::asio::error::not_connected),
            "not connected");
       }
-      return;
+      return 0;
+    }
+
+    msgpack_codec codec;
+    auto ret = codec.pack_args(rpc_name, std::forward<Args>(args)...);
+    return async_call_packed(rpc_name, std::move(ret), std::move(cb), TIMEOUT);
+  }
+
+  /**
+   * The callback async_call of a request already packed with
+   * msgpack_codec::pack_args(rpc_name, args...), e.g. to send it to several
+   * clients. timeout is in milliseconds.
+   */
+  uint64_t async_call_packed(const std::string &rpc_name, buffer_type &&ret,
+                             std::function<void(boost::system::error_code, string_view)> cb,
+                             size_t timeout = DEFAULT_TIMEOUT) {
+    if (!has_connected_) {
+      if (cb) {
+        cb(boost::asio::error::make_error_code(boost::asio::error::not_connected),
+           "not connected");
+      }
+      return 0;
+    }
+
+    if (ret.size() >= max_frame_size_) {
+      if (cb) {
+        cb(boost::asio::error::make_error_code(boost::asio::error::message_size),
+           get_error_msg(out_of_range_result()));
+      }
+      return 0;
+    }
+
+    if (!reserve_room(ret.size(), true)) {
+      if (cb) {
+        cb(boost::asio::error::make_error_code(boost::asio::error::no_buffer_space),
+           get_error_msg(no_room_result()));
+      }
+      return 0;
     }
 
     uint64_t req_id = 0;
@@ -315,15 +623,37 @@ public:
       callback_id_++;
       callback_id_ |= (req_flag << 63);
       req_id = callback_id_;
-      auto call = std::make_shared<call_t>(ios_, std::move(cb), TIMEOUT);
+      auto call = std::make_shared<call_t>(ios_, std::move(cb), timeout);
       call->start_timer();
       auto status = callback_map_.emplace(req_id, call);
       assert(status.second);
     }
 
+    write(req_id, request_type::req_res, std::move(ret),
+          method_id(rpc_name.data(), rpc_name.size()), timeout);
+    return req_id;
+  }
+
+  /**
+   * Fire and forget: nothing is registered for a response and the server sends
+   * none, errors of the call are not reported. Returns false if not connected
+   * or the request is too large.
+   */
+  template <typename... Args>
+  bool call_oneway(const std::string &rpc_name, Args &&... args) {
+    if (!has_connected_) {
+      return false;
+    }
+
     msgpack_codec codec;
     auto ret = codec.pack_args(rpc_name, std::forward<Args>(args)...);
-    write(req_id, request_type::req_res, std::move(ret));
+    if (ret.size() >= max_frame_size_ || !reserve_room(ret.size(), false)) {
+      return false;
+    }
+
+    write(0, request_type::oneway, std::move(ret),
+          method_id(rpc_name.data(), rpc_name.size()));
+    return true;
   }
 
   void stop() {
@@ -384,11 +714,28 @@ public:
 #endif
 
 private:
+  // the public constructors delegate here, a null ios means running on an
+  // io_service and a thread of our own
+  rpc_client(boost::asio::io_service *ios, std::string host, unsigned short port,
+             client_language_t client_language = client_language_t::CPP,
+             std::function<void(long, const std::string &)>
+                 on_result_received_callback = nullptr)
+      : own_ios_(ios ? nullptr : new boost::asio::io_service),
+        ios_(ios ? *ios : *own_ios_), socket_(ios_), work_(ios_),
+        host_(std::move(host)), port_(port), deadline_(ios_),
+        reconnect_timer_(ios_), body_(INIT_BUF_SIZE),
+        client_language_(client_language),
+        on_result_received_callback_(std::move(on_result_received_callback)) {
+    if (own_ios_) {
+      thd_ = std::make_shared<std::thread>([this] { ios_.run(); });
+    }
+  }
+
   void async_connect() {
     assert(port_ != 0);
     auto addr = boost::asio::ip::address::from_string(host_);
     socket_.async_connect({addr, port_},
-      [this](const boost::system::error_code &ec) {
+      guard([this](const boost::system::error_code &ec) {
         if (has_connected_) {
           return;
         } else if (ec) {
@@ -404,7 +751,14 @@ private:
             reconnect_cnt_--;
           }
 
-          async_reconnect();
+          // wait without blocking the io thread, it may be shared with other clients
+          reconnect_timer_.expires_from_now(
+              std::chrono::milliseconds(connect_timeout_));
+          reconnect_timer_.async_wait(guard([this](const boost::system::error_code &ec) {
+            if (!ec) {
+              async_reconnect();
+            }
+          }));
         } else {
           // std::cout<<"connected ok"<<std::endl;
           if (is_ssl()) {
@@ -414,23 +768,27 @@ private:
 
           has_connected_ = true;
           do_read();
+          send_negotiate();
           resend_subscribe();
           if (has_wait_) {
             conn_cond_.notify_one();
           }
         }
-      });
+      }));
   }
 
   void async_reconnect() {
     reset_socket();
     async_connect();
-    std::this_thread::sleep_for(std::chrono::milliseconds(connect_timeout_));
   }
 
   void reset_deadline_timer(size_t timeout) {
     deadline_.expires_from_now(std::chrono::seconds(timeout));
-    deadline_.async_wait([this, timeout](const boost::system::error_code &ec) {
+    deadline_.async_wait(guard([this, timeout](const boost::system::error_code &ec) {
+      if (ec == asio::error::operation_aborted) {
+        return;
+      }
+
       if (!ec) {
         if (has_connected_) {
           write(0, request_type::req_res, buffer_type(0));
@@ -438,15 +796,115 @@ private:
       }
 
       reset_deadline_timer(timeout);
-    });
+    }));
+  }
+
+  // the handlers of the client hold this instead of the client: once it is
+  // gone they return without touching it. See guard().
+  struct handler_lifetime {
+    std::mutex mtx;
+    std::condition_variable cv;
+    bool alive = true;
+    size_t running = 0;
+  };
+
+  static handler_lifetime *&current_lifetime() {
+    static thread_local handler_lifetime *current = nullptr;
+    return current;
+  }
+
+  template <typename Handler> struct guarded_handler {
+    std::shared_ptr<handler_lifetime> lifetime;
+    Handler handler;
+
+    template <typename... Args> void operator()(Args &&... args) {
+      {
+        std::lock_guard<std::mutex> lock(lifetime->mtx);
+        if (!lifetime->alive) {
+          return;
+        }
+        lifetime->running++;
+      }
+
+      struct leave_t {
+        handler_lifetime *lifetime;
+        handler_lifetime *outer;
+        ~leave_t() {
+          current_lifetime() = outer;
+          std::lock_guard<std::mutex> lock(lifetime->mtx);
+          if (--lifetime->running == 0) {
+            lifetime->cv.notify_all();
+          }
+        }
+      } leave{lifetime.get(), current_lifetime()};
+      current_lifetime() = lifetime.get();
+      handler(std::forward<Args>(args)...);
+    }
+  };
+
+  // wrap the completion handlers of the client's async operations, the
+  // io_service may be shared and still run them after the client is gone
+  template <typename Handler> guarded_handler<Handler> guard(Handler handler) {
+    return guarded_handler<Handler>{lifetime_, std::move(handler)};
   }
 
-  void write(std::uint64_t req_id, request_type type, buffer_type &&message) {
+  // the guarded handlers queued from now on are skipped, wait for the running
+  // ones, on any thread of a shared io_service, unless called from one of them
+  void wait_handlers() {
+    size_t self = current_lifetime() == lifetime_.get() ? 1 : 0;
+    std::unique_lock<std::mutex> lock(lifetime_->mtx);
+    lifetime_->alive = false;
+    lifetime_->cv.wait(lock, [this, self] { return lifetime_->running <= self; });
+  }
+
+  void write(std::uint64_t req_id, request_type type, buffer_type &&message,
+             uint32_t method = 0, size_t timeout_ms = 0) {
     size_t size = message.size();
-    assert(size < MAX_BUF_LEN);
-    client_message_type msg{req_id, type, {message.release(), size}};
+    if (size >= max_frame_size_) {
+      // the callers fail oversized requests before, the server would close on it
+      return;
+    }
+
+    client_message_type msg{req_id, type, {}, 0, method};
+    if (type >= request_type::stream_open && type <= request_type::stream_ack) {
+      msg.flags |= FLAG_STREAMING;
+    }
+    if (type == request_type::oneway) {
+      msg.flags |= FLAG_ONEWAY;
+    }
+    if (method != 0) {
+      msg.flags |= FLAG_METHOD_ID;
+    }
+    if (timeout_ms != 0) {
+      msg.flags |= FLAG_DEADLINE;
+      msg.deadline = std::chrono::steady_clock::now() +
+                     std::chrono::milliseconds(timeout_ms);
+    }
+    if (method != 0) {
+      auto trace = start_trace(req_id, type, method);
+      if (trace.trace_id != 0) {
+        msg.flags |= FLAG_TRACE;
+        msg.trace_id = trace.trace_id;
+        msg.span_id = trace.span_id;
+      }
+    }
+
+    auto compression = compression_.load();
+    std::string packed;
+    if ((type == request_type::req_res || type == request_type::oneway) &&
+        compression != compress_type::none &&
+        size >= compress_threshold_ &&
+        compress(compression, message.data(), size, packed)) {
+      char *data = (char *)::malloc(packed.size());
+      memcpy(data, packed.data(), packed.size());
+      msg.flags |= FLAG_COMPRESSED;
+      msg.content = {data, packed.size()};
+    } else {
+      msg.content = {message.release(), size};
+    }
 
     std::unique_lock<std::mutex> lock(write_mtx_);
+    outbox_bytes_ += msg.content.length();
     outbox_.emplace_back(std::move(msg));
     if (outbox_.size() > 1) {
       // outstanding async_write
@@ -457,14 +915,65 @@ private:
     }
   }
 
+  // join the trace of the calling thread or sample a new one, returns the
+  // client's span of the call, trace_id 0 if it isn't traced. The span ends
+  // when the response is read.
+  trace_context start_trace(std::uint64_t req_id, request_type type, uint32_t method) {
+    auto parent = current_trace();
+    if (parent.trace_id == 0) {
+      if (!get_tracer().sample()) {
+        return trace_context{};
+      }
+      parent = trace_context{tracer::new_id(), 0};
+    }
+
+    trace_context span{parent.trace_id, tracer::new_id()};
+    if (type == request_type::req_res) {
+      std::lock_guard<std::mutex> lock(cb_mtx_);
+      traced_calls_[req_id] = traced_call{parent, span.span_id, method,
+                                          std::chrono::steady_clock::now()};
+    }
+    return span;
+  }
+
+  // called with cb_mtx_ held
+  void end_trace(uint64_t req_id) {
+    if (traced_calls_.empty()) {
+      return;
+    }
+
+    auto it = traced_calls_.find(req_id);
+    if (it == traced_calls_.end()) {
+      return;
+    }
+
+    auto &call = it->second;
+    get_tracer().record(span_kind::client_call, call.parent, call.span_id,
+                        call.method, call.start,
+                        std::chrono::steady_clock::now());
+    traced_calls_.erase(it);
+  }
+
   void write() {
     auto &msg = outbox_[0];
-    write_size_ = (uint32_t)msg.content.length();
-    std::array<boost::asio::const_buffer, 4> write_buffers;
-    write_buffers[0] = boost::asio::buffer(&write_size_, sizeof(int32_t));
-    write_buffers[1] = boost::asio::buffer(&msg.req_id, sizeof(uint64_t));
-    write_buffers[2] = boost::asio::buffer(&msg.req_type, sizeof(request_type));
-    write_buffers[3] = boost::asio::buffer((char *)msg.content.data(), write_size_);
+    const bool v2 = write_v2_;
+    frame_header header{msg.req_id, msg.req_type,
+                        (uint8_t)(v2 ? msg.flags : 0),
+                        (uint32_t)msg.content.length(), msg.method_id, 0};
+    header.trace_id = msg.trace_id;
+    header.parent_span_id = msg.span_id;
+    if (header.flags & FLAG_DEADLINE) {
+      // what is left of it now, the request may have waited in the outbox
+      auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+          msg.deadline - std::chrono::steady_clock::now());
+      header.deadline_ms = (uint32_t)(std::max)(left.count(), (decltype(left.count()))1);
+    }
+    size_t head_len = encode_head(header, v2, write_head_);
+    size_t tail_len = encode_trailer(header, write_trailer_);
+    std::array<boost::asio::const_buffer, 3> write_buffers;
+    write_buffers[0] = boost::asio::buffer(write_head_, head_len);
+    write_buffers[1] = boost::asio::buffer((char *)msg.content.data(), msg.content.length());
+    write_buffers[2] = boost::asio::buffer(write_trailer_, tail_len);
 
     async_write(write_buffers, [this](const boost::system::error_code &ec, const size_t length) {
       if (ec) {
@@ -476,6 +985,7 @@ private:
         if (outbox_.empty()) {
           return;
         } else {
+          outbox_bytes_ -= outbox_.front().content.length();
           ::free((char *)outbox_.front().content.data());
           outbox_.pop_front();
           if (!outbox_.empty()) {
@@ -484,43 +994,67 @@ private:
           }
         }
       }
+      notify_room();
     });
   }
 
   void do_read() {
     async_read_head(
+        read_v2_ ? HEAD_LEN_V2 : HEAD_LEN,
         [this](const boost::system::error_code &ec, const size_t length) {
           if (!socket_.is_open()) {
             std::cout << "socket already closed" << std::endl;
             has_connected_ = false;
             return;
-          } else if (!ec) {
-            // const uint32_t body_len = *((uint32_t*)(head_));
-            // auto req_id = *((std::uint64_t*)(head_ + sizeof(int32_t)));
-            // auto req_type = *(request_type*)(head_ + sizeof(int32_t) + sizeof(int64_t));
-            rpc_header *header = (rpc_header *)(head_);
-            const uint32_t body_len = header->body_len;
-            if (body_len > 0 && body_len < MAX_BUF_LEN) {
-              if (body_.size() < body_len) {
-                body_.resize(body_len);
-              }
-              read_body(header->req_id, header->req_type, body_len);
-              return;
-            } else if (body_len == 0 || body_len > MAX_BUF_LEN) {
-              std::cout << "invalid body len" << std::endl;
-              close();
-              error_callback(asio::error::make_error_code(asio::error::message_size));
-              return;
-            }
-          } else {
+          } else if (ec) {
             close(false);
             error_callback(ec);
+            return;
           }
+
+          if (read_v2_ || !is_v2_head(head_)) {
+            on_head();
+            return;
+          }
+
+          // the server switched to v2 headers, they are all v2 from now on
+          read_v2_ = true;
+          async_read_head(
+              HEAD_LEN_V2 - HEAD_LEN,
+              [this](const boost::system::error_code &ec, const size_t length) {
+                if (ec) {
+                  close(false);
+                  error_callback(ec);
+                  return;
+                }
+
+                on_head();
+              },
+              HEAD_LEN);
         });
   }
 
-  void read_body(std::uint64_t req_id, request_type req_type, size_t body_len) {
-    async_read(body_len, [this, req_id, req_type, body_len](
+  void on_head() {
+    auto header = decode_head(head_, read_v2_);
+    const uint32_t body_len = header.body_len;
+    if (body_len > 0 && body_len < max_frame_size_) {
+      size_t size = body_len + trailer_len(header.flags);
+      if (body_.size() < size) {
+        body_.resize(size);
+      }
+      read_body(header.req_id, header.req_type, size,
+                (header.flags & FLAG_COMPRESSED) != 0, body_len);
+      return;
+    }
+
+    std::cout << "invalid body len" << std::endl;
+    close();
+    error_callback(asio::error::make_error_code(asio::error::message_size));
+  }
+
+  void read_body(std::uint64_t req_id, request_type req_type, size_t size,
+                 bool compressed, size_t body_len) {
+    async_read(size, [this, req_id, req_type, body_len, compressed](
                          boost::system::error_code ec, std::size_t length) {
       // cancel_timer();
       if (!socket_.is_open()) {
@@ -531,16 +1065,35 @@ private:
         return;
       } else if (!ec) {
         // entier body
+        string_view body(body_.data(), body_len);
+        std::vector<char> plain;
+        if (compressed && !decompress_body(body, plain)) {
+          close();
+          error_callback(asio::error::make_error_code(asio::error::invalid_argument));
+          return;
+        }
+
         if (req_type == request_type::req_res) {
-          call_back(req_id, ec, {body_.data(), body_len});
+          call_back(req_id, ec, body);
         } else if (req_type == request_type::sub_pub) {
-          callback_sub(ec, {body_.data(), body_len});
+          callback_sub(ec, body);
+        } else if (req_type == request_type::stream_data ||
+                   req_type == request_type::stream_end ||
+                   req_type == request_type::stream_ack) {
+          on_stream_frame(req_id, req_type, body);
+        } else if (req_type == request_type::negotiate) {
+          on_negotiate(body);
         } else {
           close();
           error_callback(asio::error::make_error_code(asio::error::invalid_argument));
           return;
         }
 
+        if (body_.size() > MAX_RETAINED_BUF_LEN) {
+          // don't keep the memory of one large response for the connection's lifetime
+          std::vector<char>(INIT_BUF_SIZE).swap(body_);
+        }
+
         do_read();
       } else {
         // std::cout << ec.message() << std::endl;
@@ -551,6 +1104,118 @@ private:
     });
   }
 
+  // announce our limit and codec on every (re)connect, the server answers with the
+  // negotiated ones; a server without negotiation doesn't answer and we keep ours.
+  void send_negotiate() {
+    max_frame_size_ = local_max_frame_size_;
+    compression_ = compress_type::none;
+    write_v2_ = false;
+    std::vector<int> codecs;
+    if (is_compression_supported(offered_compression_)) {
+      codecs.push_back((int)offered_compression_);
+    }
+
+    msgpack_codec codec;
+    auto ret = codec.pack_args((uint64_t)local_max_frame_size_, codecs,
+                               (int)HEADER_VERSION);
+    write(0, request_type::negotiate, std::move(ret));
+  }
+
+  void on_negotiate(string_view data) {
+    try {
+      msgpack_codec codec;
+      auto tp = codec.unpack<std::tuple<uint64_t, int, int>>(data.data(),
+                                                              data.size());
+      auto limit = std::get<0>(tp);
+      if (limit > 0 && limit < local_max_frame_size_) {
+        max_frame_size_ = (size_t)limit;
+      }
+
+      if (std::get<2>(tp) >= 2) {
+        write_v2_ = true;
+      }
+
+      auto type = (compress_type)std::get<1>(tp);
+      if (type == offered_compression_) {
+        compression_ = type;
+      }
+    } catch (const std::exception &ex) {
+      std::cout << ex.what() << std::endl;
+    }
+  }
+
+  bool decompress_body(string_view &body, std::vector<char> &plain) {
+    auto size = original_size(body.data(), body.size());
+    if (size == 0 || size >= local_max_frame_size_) {
+      return false;
+    }
+
+    plain.resize(size);
+    if (!decompress(compression_, body.data(), body.size(), plain.data(), size)) {
+      return false;
+    }
+
+    body = string_view(plain.data(), size);
+    return true;
+  }
+
+  // count a request against the in-flight limits, counted ones wait for a
+  // response. A single request larger than the byte limit goes alone.
+  bool reserve_room(size_t size, bool counted) {
+    if (max_inflight_ == 0 && max_outbox_bytes_ == 0) {
+      if (counted) {
+        outstanding_++;
+      }
+      return true;
+    }
+
+    std::unique_lock<std::mutex> lock(room_mtx_);
+    auto has_room = [this, size, counted] {
+      return (!counted || max_inflight_ == 0 || outstanding_ < max_inflight_) &&
+             (max_outbox_bytes_ == 0 || outbox_bytes_ == 0 ||
+              outbox_bytes_ + size <= max_outbox_bytes_);
+    };
+
+    if (!has_room()) {
+      // waiting on the io thread would keep the responses from coming in
+      if (overflow_policy_ == overflow_policy::fail ||
+          ios_.get_executor().running_in_this_thread()) {
+        return false;
+      }
+
+      room_waiters_++;
+      bool ok = room_cv_.wait_for(
+          lock, std::chrono::milliseconds(overflow_wait_ms_), has_room);
+      room_waiters_--;
+      if (!ok) {
+        return false;
+      }
+    }
+
+    if (counted) {
+      outstanding_++;
+    }
+    return true;
+  }
+
+  void notify_room() {
+    if (room_waiters_ > 0) {
+      std::lock_guard<std::mutex> lock(room_mtx_);
+      room_cv_.notify_all();
+    }
+  }
+
+  std::string no_room_result() const {
+    return msgpack_codec::pack_args_str(result_code::FAIL,
+                                        "too many requests in flight");
+  }
+
+  std::string out_of_range_result() const {
+    return msgpack_codec::pack_args_str(
+        result_code::FAIL, "the request is out of range: more than " +
+                               std::to_string(max_frame_size_.load()) + " bytes");
+  }
+
   void send_subscribe(const std::string &key, const std::string &token) {
     msgpack_codec codec;
     auto ret = codec.pack_args(key, token);
@@ -573,44 +1238,52 @@ private:
       return;
     }
 
-    std::unique_lock<std::mutex> lock(cb_mtx_);
-
     if (client_language_ == client_language_t::JAVA) {
       // For Java client.
       // TODO(qwang): Call java callback.
       // handle error.
       on_result_received_callback_(req_id, std::string(data.data(), data.size()));
-    } else {
-      // For CPP client.
+      return;
+    }
+
+    // For CPP client.
+    std::shared_ptr<call_t> cb_ptr;
+    std::shared_ptr<std::promise<req_result>> f_ptr;
+    {
+      std::lock_guard<std::mutex> lock(cb_mtx_);
       req_id_tmp_ = req_id;
+      end_trace(req_id);
       uint64_t req_flag = req_id >> 63;
       if (req_flag) {
-        // std::shared_ptr<call_t> cb_ptr(std::move(callback_map_[req_id]));
-        auto & cb_ptr = callback_map_[req_id];
-
-        if (cb_ptr) {
-          if (!cb_ptr->has_timeout()) {
-            cb_ptr->cancel();
-            cb_ptr->callback(ec, data);
-          } else {
-            cb_ptr->callback(asio::error::make_error_code(asio::error::timed_out), {});
-          }
-        } else {
-          // assert(cb_ptr);
+        auto it = callback_map_.find(req_id);
+        if (it == callback_map_.end()) {
+          return;
         }
-
-        callback_map_.erase(req_id);
+        cb_ptr = std::move(it->second);
+        callback_map_.erase(it);
       } else {
-        // std::shared_ptr<std::promise<req_result>> f_ptr(std::move(future_map_[req_id]));
-        auto & f_ptr = future_map_[req_id];
-
-        if (f_ptr) {
-          f_ptr->set_value(req_result{data});
-          future_map_.erase(req_id);
-        } else {
-          // assert(f_ptr);
+        // also when it was cancelled and the response crossed the cancel frame
+        auto it = future_map_.find(req_id);
+        if (it == future_map_.end()) {
+          return;
         }
+        f_ptr = std::move(it->second);
+        future_map_.erase(it);
+      }
+      outstanding_--;
+    }
+    notify_room();
+
+    // outside cb_mtx_, a callback may call into this client or cancel a call of another one
+    if (cb_ptr) {
+      if (!cb_ptr->has_timeout()) {
+        cb_ptr->cancel();
+        cb_ptr->callback(ec, data);
+      } else {
+        cb_ptr->callback(asio::error::make_error_code(asio::error::timed_out), {});
       }
+    } else if (f_ptr) {
+      f_ptr->set_value(req_result{data});
     }
   }
 
@@ -633,6 +1306,42 @@ private:
     }
   }
 
+  void on_stream_frame(uint64_t stream_id, request_type type, string_view data) {
+    stream_ptr stream;
+    {
+      std::lock_guard<std::mutex> lock(streams_mtx_);
+      auto it = streams_.find(stream_id);
+      if (it == streams_.end()) {
+        return;
+      }
+      stream = it->second;
+    }
+
+    try {
+      if (type == request_type::stream_data) {
+        stream->on_data(data.data(), data.size());
+      } else if (type == request_type::stream_end) {
+        stream->on_end(data.data(), data.size());
+      } else {
+        stream->on_ack(data.data(), data.size());
+      }
+    } catch (const std::exception & /*ex*/) {
+      error_callback(asio::error::make_error_code(asio::error::invalid_argument));
+    }
+  }
+
+  void abort_streams() {
+    std::unordered_map<std::uint64_t, stream_ptr> streams;
+    {
+      std::lock_guard<std::mutex> lock(streams_mtx_);
+      streams.swap(streams_);
+    }
+
+    for (auto &stream : streams) {
+      stream.second->abort("connection closed");
+    }
+  }
+
   void clear_cache() {
     {
       std::lock_guard<std::mutex> lock(write_mtx_);
@@ -640,16 +1349,21 @@ private:
         ::free((char *)outbox_.front().content.data());
         outbox_.pop_front();
       }
+      outbox_bytes_ = 0;
     }
 
     {
       std::lock_guard<std::mutex> lock(cb_mtx_);
       callback_map_.clear();
       future_map_.clear();
+      traced_calls_.clear();
+      outstanding_ = 0;
     }
+    notify_room();
   }
 
   void reset_socket() {
+    read_v2_ = false;
     boost::system::error_code igored_ec;
     socket_.close(igored_ec);
     socket_ = decltype(socket_)(ios_);
@@ -728,10 +1442,11 @@ private:
   void handshake() {
 #ifdef CINATRA_ENABLE_SSL
     ssl_stream_->async_handshake(boost::asio::ssl::stream_base::client,
-                                 [this](const boost::system::error_code &ec) {
+                                 guard([this](const boost::system::error_code &ec) {
                                    if (!ec) {
                                      has_connected_ = true;
                                      do_read();
+                                     send_negotiate();
                                      resend_subscribe();
                                      if (has_wait_)
                                        conn_cond_.notify_one();
@@ -739,7 +1454,7 @@ private:
                                      error_callback(ec);
                                      close();
                                    }
-                                 });
+                                 }));
 #endif
   }
 
@@ -764,16 +1479,17 @@ private:
 #endif
   }
 
-  template <typename Handler> void async_read_head(Handler handler) {
+  template <typename Handler>
+  void async_read_head(size_t size, Handler handler, size_t offset = 0) {
     if (is_ssl()) {
 #ifdef CINATRA_ENABLE_SSL
       boost::asio::async_read(*ssl_stream_,
-                              boost::asio::buffer(head_, HEAD_LEN),
-                              std::move(handler));
+                              boost::asio::buffer(head_ + offset, size),
+                              guard(std::move(handler)));
 #endif
     } else {
-      boost::asio::async_read(socket_, boost::asio::buffer(head_, HEAD_LEN),
-                              std::move(handler));
+      boost::asio::async_read(socket_, boost::asio::buffer(head_ + offset, size),
+                              guard(std::move(handler)));
     }
   }
 
@@ -783,12 +1499,12 @@ private:
 #ifdef CINATRA_ENABLE_SSL
       boost::asio::async_read(*ssl_stream_,
                               boost::asio::buffer(body_.data(), size_to_read),
-                              std::move(handler));
+                              guard(std::move(handler)));
 #endif
     } else {
       boost::asio::async_read(socket_,
                               boost::asio::buffer(body_.data(), size_to_read),
-                              std::move(handler));
+                              guard(std::move(handler)));
     }
   }
 
@@ -796,14 +1512,15 @@ private:
   void async_write(const BufferType &buffers, Handler handler) {
     if (is_ssl()) {
 #ifdef CINATRA_ENABLE_SSL
-      boost::asio::async_write(*ssl_stream_, buffers, std::move(handler));
+      boost::asio::async_write(*ssl_stream_, buffers, guard(std::move(handler)));
 #endif
     } else {
-      boost::asio::async_write(socket_, buffers, std::move(handler));
+      boost::asio::async_write(socket_, buffers, guard(std::move(handler)));
     }
   }
 
-  boost::asio::io_service ios_;
+  std::unique_ptr<boost::asio::io_service> own_ios_;
+  boost::asio::io_service &ios_;
   asio::ip::tcp::socket socket_;
 #ifdef CINATRA_ENABLE_SSL
   std::unique_ptr<boost::asio::ssl::stream<boost::asio::ip::tcp::socket &>>
@@ -823,14 +1540,22 @@ private:
   bool has_wait_ = false;
 
   asio::steady_timer deadline_;
+  asio::steady_timer reconnect_timer_;
 
   struct client_message_type {
     std::uint64_t req_id;
     request_type req_type;
     string_view content;
+    uint8_t flags;
+    uint32_t method_id;
+    std::chrono::steady_clock::time_point deadline;
+    uint64_t trace_id;
+    uint64_t span_id;
   };
   std::deque<client_message_type> outbox_;
-  uint32_t write_size_ = 0;
+  char write_head_[HEAD_LEN_V2] = {};
+  char write_trailer_[24] = {};
+  std::atomic_bool write_v2_ = {false};
   std::mutex write_mtx_;
   uint64_t fu_id_ = 0;
   std::function<void(boost::system::error_code)> err_cb_;
@@ -839,12 +1564,38 @@ private:
   std::unordered_map<std::uint64_t, std::shared_ptr<std::promise<req_result>>>
       future_map_;
   std::unordered_map<std::uint64_t, std::shared_ptr<call_t>> callback_map_;
+  struct traced_call {
+    trace_context parent;
+    uint64_t span_id;
+    uint32_t method;
+    std::chrono::steady_clock::time_point start;
+  };
+  std::unordered_map<std::uint64_t, traced_call> traced_calls_;  // sampled calls waiting for a response
   std::mutex cb_mtx_;
   uint64_t callback_id_ = 0;
 
+  std::unordered_map<std::uint64_t, stream_ptr> streams_;
+  std::mutex streams_mtx_;
+  uint64_t stream_id_ = 0;
+  std::atomic<size_t> outstanding_ = {0};
+  std::atomic<size_t> outbox_bytes_ = {0};
+  std::mutex room_mtx_;
+  std::condition_variable room_cv_;
+  std::atomic<size_t> room_waiters_ = {0};
+  std::atomic<size_t> max_inflight_ = {0};
+  std::atomic<size_t> max_outbox_bytes_ = {0};
+  overflow_policy overflow_policy_ = overflow_policy::block;
+  size_t overflow_wait_ms_ = DEFAULT_TIMEOUT;
+  size_t local_max_frame_size_ = MAX_BUF_LEN;
+  std::atomic<size_t> max_frame_size_ = {MAX_BUF_LEN};
+  compress_type offered_compression_ = compress_type::none;
+  size_t compress_threshold_ = COMPRESS_THRESHOLD;
+  std::atomic<compress_type> compression_ = {compress_type::none};
+
   uint64_t req_id_tmp_ = 0;
 
-  char head_[HEAD_LEN] = {};
+  char head_[HEAD_LEN_V2] = {};
+  bool read_v2_ = false;
   std::vector<char> body_;
 
   std::unordered_map<std::string, std::function<void(string_view)>> sub_map_;
@@ -852,5 +1603,6 @@ private:
 
   client_language_t client_language_ = client_language_t::CPP;
   std::function<void(long, const std::string &)> on_result_received_callback_;
+  std::shared_ptr<handler_lifetime> lifetime_ = std::make_shared<handler_lifetime>();
 };
 }
@@ -0,0 +1,407 @@
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <random>
+#include <vector>
+#include "io_service_pool.h"
+#include "rpc_client.hpp"
+
+namespace rest_rpc {
+
+/**
+ * How rpc_client_pool picks a connection for the next call.
+ */
+enum class balance_policy {
+  round_robin,
+  least_outstanding, // the connection with the fewest unanswered requests
+  power_of_two,      // the less loaded of two random connections
+};
+
+/**
+ * When rpc_client_pool::hedged_call sends a second copy of a call to another
+ * connection: once it is slower than `percentile` of the recent calls, within
+ * [min_delay, max_delay]. max_delay is used until enough calls were seen.
+ */
+struct hedge_policy {
+  double percentile = 0.95;
+  std::chrono::milliseconds min_delay{1};
+  std::chrono::milliseconds max_delay{100};
+};
+
+static const size_t HEDGE_LATENCY_WINDOW = 1024; // latencies of the last calls the delay comes from
+static const size_t HEDGE_DELAY_UPDATE = 64;     // calls between two updates of the delay
+
+/**
+ * N connections to each of M endpoints, all running on a small shared pool
+ * of io threads instead of one thread per rpc_client.
+ */
+class rpc_client_pool : private asio::noncopyable {
+public:
+  rpc_client_pool(size_t io_threads = 1,
+                  balance_policy policy = balance_policy::round_robin)
+      : io_pool_(io_threads), policy_(policy) {
+    thd_ = std::make_shared<std::thread>([this] { io_pool_.run(); });
+  }
+
+  ~rpc_client_pool() {
+    // the loops stop first, ~rpc_client then closes the sockets without
+    // racing their handlers
+    io_pool_.stop();
+    if (thd_->joinable()) {
+      thd_->join();
+    }
+    clients_.clear();
+  }
+
+  // add endpoints before connect, the pool is not resized afterwards
+  void add_endpoint(const std::string &host, unsigned short port,
+                    size_t connections = 1) {
+    for (size_t i = 0; i < connections; ++i) {
+      clients_.push_back(
+          std::make_shared<rpc_client>(io_pool_.get_io_service(), host, port));
+      endpoints_.emplace_back(host, port);
+    }
+  }
+
+  // connect all the connections, false if none of them could be established
+  bool connect(size_t timeout = 3) {
+    for (size_t i = 0; i < clients_.size(); ++i) {
+      clients_[i]->async_connect(endpoints_[i].first, endpoints_[i].second);
+    }
+
+    bool has_connected = false;
+    for (auto &client : clients_) {
+      if (client->wait_conn(timeout)) {
+        has_connected = true;
+      }
+    }
+
+    return has_connected;
+  }
+
+  size_t size() const { return clients_.size(); }
+
+  std::shared_ptr<rpc_client> get_client() {
+    if (clients_.empty()) {
+      return nullptr;
+    }
+
+    switch (policy_) {
+    case balance_policy::least_outstanding:
+      return least_outstanding();
+    case balance_policy::power_of_two:
+      return power_of_two();
+    default:
+      return round_robin();
+    }
+  }
+
+  template <size_t TIMEOUT, typename T = void, typename... Args>
+  auto call(const std::string &rpc_name, Args &&... args)
+      -> decltype(std::declval<rpc_client &>().template call<TIMEOUT, T>(
+          rpc_name, std::forward<Args>(args)...)) {
+    return checked_client()->template call<TIMEOUT, T>(
+        rpc_name, std::forward<Args>(args)...);
+  }
+
+  template <typename T = void, typename... Args>
+  auto call(const std::string &rpc_name, Args &&... args)
+      -> decltype(std::declval<rpc_client &>().template call<T>(
+          rpc_name, std::forward<Args>(args)...)) {
+    return checked_client()->template call<T>(rpc_name,
+                                               std::forward<Args>(args)...);
+  }
+
+  template <CallModel model, typename... Args>
+  std::future<req_result> async_call(const std::string &rpc_name,
+                                     Args &&... args) {
+    return checked_client()->template async_call<model>(
+        rpc_name, std::forward<Args>(args)...);
+  }
+
+  template <size_t TIMEOUT = DEFAULT_TIMEOUT, typename... Args>
+  void async_call(const std::string &rpc_name,
+                  std::function<void(boost::system::error_code, string_view)> cb,
+                  Args &&... args) {
+    checked_client()->template async_call<TIMEOUT>(rpc_name, std::move(cb),
+                                                   std::forward<Args>(args)...);
+  }
+
+  void set_hedge_policy(hedge_policy policy) {
+    std::lock_guard<std::mutex> lock(latency_mtx_);
+    hedge_policy_ = policy;
+    hedge_delay_ = std::chrono::duration_cast<std::chrono::microseconds>(
+                       policy.max_delay)
+                       .count();
+  }
+
+  /**
+   * The callback async_call, reissued to another connection if no response
+   * came within the hedge_policy delay. The first response wins and the
+   * other request is cancelled. Only use it for idempotent calls.
+   */
+  template <size_t TIMEOUT = DEFAULT_TIMEOUT, typename... Args>
+  void hedged_call(const std::string &rpc_name,
+                   std::function<void(boost::system::error_code, string_view)> cb,
+                   Args &&... args) {
+    auto state = std::make_shared<hedge_state>();
+    state->rpc_name = rpc_name;
+    state->cb = std::move(cb);
+    state->timeout = TIMEOUT;
+    auto buf = msgpack_codec::pack_args(rpc_name, std::forward<Args>(args)...);
+    state->packed.assign(buf.data(), buf.size());
+    state->start = std::chrono::steady_clock::now();
+    state->clients[0] = checked_client();
+    state->timer_ios = &io_pool_.get_io_service();
+    state->timer = std::make_shared<asio::steady_timer>(*state->timer_ios);
+
+    send_attempt(state, 0);
+
+    // the state owns the timer, the handler only a weak reference to it
+    std::weak_ptr<hedge_state> weak = state;
+    state->timer->expires_from_now(std::chrono::microseconds(hedge_delay_.load()));
+    state->timer->async_wait([this, weak](const boost::system::error_code &ec) {
+      auto state = weak.lock();
+      if (!ec && state != nullptr) {
+        hedge(state);
+      }
+    });
+  }
+
+  template <size_t TIMEOUT = DEFAULT_TIMEOUT, typename... Args>
+  std::future<req_result> async_hedged_call(const std::string &rpc_name,
+                                            Args &&... args) {
+    auto p = std::make_shared<std::promise<req_result>>();
+    auto future = p->get_future();
+    hedged_call<TIMEOUT>(
+        rpc_name,
+        [p](boost::system::error_code ec, string_view data) {
+          if (ec) {
+            p->set_value(req_result(
+                msgpack_codec::pack_args_str(result_code::FAIL, ec.message())));
+          } else {
+            p->set_value(req_result(data));
+          }
+        },
+        std::forward<Args>(args)...);
+    return future;
+  }
+
+  // calls reissued by hedged_call, and how many of them answered first
+  uint64_t hedged_calls() const { return hedged_calls_; }
+  uint64_t hedge_wins() const { return hedge_wins_; }
+
+private:
+  struct hedge_state {
+    std::mutex mtx;
+    std::string rpc_name;
+    std::string packed;
+    std::function<void(boost::system::error_code, string_view)> cb;
+    size_t timeout = 0;
+    std::chrono::steady_clock::time_point start;
+    std::shared_ptr<rpc_client> clients[2];
+    uint64_t req_ids[2] = {0, 0};
+    bool failed[2] = {false, false};
+    bool done = false;
+    asio::io_service *timer_ios = nullptr;
+    std::shared_ptr<asio::steady_timer> timer;  // sends the hedge, cancelled once done
+  };
+
+  void send_attempt(const std::shared_ptr<hedge_state> &state, int i) {
+    buffer_type buf(state->packed.size());
+    buf.write(state->packed.data(), state->packed.size());
+    auto req_id = state->clients[i]->async_call_packed(
+        state->rpc_name, std::move(buf),
+        [this, state, i](boost::system::error_code ec, string_view data) {
+          on_attempt(state, i, ec, data);
+        },
+        state->timeout);
+
+    bool cancel_it = false;
+    {
+      std::lock_guard<std::mutex> lock(state->mtx);
+      state->req_ids[i] = req_id;
+      // the other attempt answered while this one was being sent
+      cancel_it = state->done && req_id != 0;
+    }
+
+    if (cancel_it) {
+      state->clients[i]->cancel(req_id);
+    }
+  }
+
+  void hedge(const std::shared_ptr<hedge_state> &state) {
+    auto client = other_client(state->clients[0]);
+    if (client == nullptr) {
+      return;
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(state->mtx);
+      if (state->done) {
+        return;
+      }
+      state->clients[1] = client;
+    }
+
+    hedged_calls_++;
+    send_attempt(state, 1);
+  }
+
+  void on_attempt(const std::shared_ptr<hedge_state> &state, int i,
+                  boost::system::error_code ec, string_view data) {
+    std::shared_ptr<rpc_client> loser;
+    uint64_t loser_id = 0;
+    {
+      std::lock_guard<std::mutex> lock(state->mtx);
+      if (state->done) {
+        return;  // the loser, cancelled or late
+      }
+
+      int other = 1 - i;
+      if (ec) {
+        state->failed[i] = true;
+        if (state->clients[other] != nullptr && !state->failed[other]) {
+          return;  // the other attempt may still succeed
+        }
+      }
+
+      state->done = true;
+      if (state->clients[other] != nullptr && !state->failed[other]) {
+        loser = state->clients[other];
+        loser_id = state->req_ids[other];
+      }
+    }
+
+    if (!ec) {
+      add_latency(std::chrono::duration_cast<std::chrono::microseconds>(
+          std::chrono::steady_clock::now() - state->start));
+      if (i == 1) {
+        hedge_wins_++;
+      }
+    }
+
+    // cancelled on its io_service rather than racing a running handler
+    auto timer = state->timer;
+    state->timer_ios->post([timer] {
+      boost::system::error_code ignored_ec;
+      timer->cancel(ignored_ec);
+    });
+
+    if (loser != nullptr && loser_id != 0) {
+      loser->cancel(loser_id);
+    }
+
+    state->cb(ec, data);
+  }
+
+  // a connected client other than `client`, nullptr if there is none
+  std::shared_ptr<rpc_client> other_client(const std::shared_ptr<rpc_client> &client) {
+    size_t size = clients_.size();
+    size_t start = next_++;
+    for (size_t i = 0; i < size; ++i) {
+      auto &other = clients_[(start + i) % size];
+      if (other != client && other->has_connected()) {
+        return other;
+      }
+    }
+
+    return nullptr;
+  }
+
+  // the delay follows the latency window, recomputed every HEDGE_DELAY_UPDATE calls
+  void add_latency(std::chrono::microseconds latency) {
+    std::lock_guard<std::mutex> lock(latency_mtx_);
+    latencies_[latency_count_++ % HEDGE_LATENCY_WINDOW] = latency.count();
+    if (latency_count_ < HEDGE_LATENCY_WINDOW / 8 ||
+        latency_count_ % HEDGE_DELAY_UPDATE != 0) {
+      return;
+    }
+
+    size_t n = (std::min)(latency_count_, HEDGE_LATENCY_WINDOW);
+    sorted_.assign(latencies_.begin(), latencies_.begin() + n);
+    auto nth = sorted_.begin() + (size_t)(hedge_policy_.percentile * (n - 1));
+    std::nth_element(sorted_.begin(), nth, sorted_.end());
+
+    using std::chrono::microseconds;
+    int64_t min_delay = std::chrono::duration_cast<microseconds>(hedge_policy_.min_delay).count();
+    int64_t max_delay = std::chrono::duration_cast<microseconds>(hedge_policy_.max_delay).count();
+    hedge_delay_ = (std::min)((std::max)(*nth, min_delay), max_delay);
+  }
+
+  std::shared_ptr<rpc_client> checked_client() {
+    auto client = get_client();
+    if (client == nullptr) {
+      throw std::logic_error("rpc_client_pool has no endpoint");
+    }
+
+    return client;
+  }
+
+  // disconnected clients are skipped, unless none of them is connected
+  std::shared_ptr<rpc_client> round_robin() {
+    size_t size = clients_.size();
+    size_t start = next_++;
+    for (size_t i = 0; i < size; ++i) {
+      auto &client = clients_[(start + i) % size];
+      if (client->has_connected()) {
+        return client;
+      }
+    }
+
+    return clients_[start % size];
+  }
+
+  std::shared_ptr<rpc_client> least_outstanding() {
+    size_t size = clients_.size();
+    size_t start = next_++;
+    std::shared_ptr<rpc_client> best = nullptr;
+    for (size_t i = 0; i < size; ++i) {
+      auto &client = clients_[(start + i) % size];
+      if (!client->has_connected()) {
+        continue;
+      }
+
+      if (best == nullptr || client->outstanding() < best->outstanding()) {
+        best = client;
+      }
+    }
+
+    return best ? best : clients_[start % size];
+  }
+
+  std::shared_ptr<rpc_client> power_of_two() {
+    static thread_local std::minstd_rand rand(std::random_device{}());
+    size_t size = clients_.size();
+    auto &first = clients_[rand() % size];
+    auto &second = clients_[rand() % size];
+    if (!first->has_connected() && !second->has_connected()) {
+      return round_robin();
+    }
+
+    if (first->has_connected() != second->has_connected()) {
+      return first->has_connected() ? first : second;
+    }
+
+    return first->outstanding() <= second->outstanding() ? first : second;
+  }
+
+  rpc_service::io_service_pool io_pool_;
+  std::shared_ptr<std::thread> thd_;
+  balance_policy policy_;
+  std::vector<std::shared_ptr<rpc_client>> clients_;
+  std::vector<std::pair<std::string, unsigned short>> endpoints_;
+  std::atomic<size_t> next_ = {0};
+
+  std::mutex latency_mtx_;
+  hedge_policy hedge_policy_;
+  std::vector<int64_t> latencies_ = std::vector<int64_t>(HEDGE_LATENCY_WINDOW);
+  std::vector<int64_t> sorted_;
+  size_t latency_count_ = 0;
+  std::atomic<int64_t> hedge_delay_ = {100 * 1000};
+  std::atomic<uint64_t> hedged_calls_ = {0};
+  std::atomic<uint64_t> hedge_wins_ = {0};
+};
+} // namespace rest_rpc
@@ -7,6 +7,9 @@
 #include "connection.h"
 #include "io_service_pool.h"
 #include "router.h"
+#include "stats.h"
+#include "metrics_http.h"
+#include "flight_recorder.h"
 
 using boost::asio::ip::tcp;
 
@@ -20,6 +23,8 @@ namespace rest_rpc {
                 acceptor_(io_service_pool_.get_io_service(), tcp::endpoint(tcp::v4(), port)),
                 timeout_seconds_(timeout_seconds),
                 check_seconds_(check_seconds) {
+                router_.register_handler<ExecMode::sync>(STATS_RPC_NAME, &rpc_server::stats_rpc, this);
+                router_.register_handler<ExecMode::sync>(FLIGHT_RECORDER_RPC_NAME, &rpc_server::flight_recorder_rpc, this);
                 do_accept();
                 check_thread_ = std::make_shared<std::thread>([this] { clean(); });
                 pub_sub_thread_ = std::make_shared<std::thread>([this] { clean_sub_pub(); });
@@ -54,6 +59,54 @@ namespace rest_rpc {
                 if(thd_){
                     thd_->join();
                 }
+
+                // the stream handlers wait on their streams, wake them up before joining
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    for (auto& conn : connections_) {
+                        conn.second->abort_streams();
+                    }
+                }
+                stream_ios_.stop();
+                for (auto& thd : stream_threads_) {
+                    thd->join();
+                }
+
+                worker_ios_.stop();
+                for (auto& thd : worker_threads_) {
+                    thd->join();
+                }
+            }
+
+            // execute handlers on a pool of worker threads so that requests pipelined on one
+            // connection run concurrently, responses are written back as each one completes.
+            // call it before run(), 0 means executing handlers on the io threads.
+            void set_worker_threads(size_t size) {
+                if (size == 0 || !worker_threads_.empty()) {
+                    return;
+                }
+
+                worker_work_ = std::make_shared<boost::asio::io_service::work>(worker_ios_);
+                for (size_t i = 0; i < size; ++i) {
+                    worker_threads_.emplace_back(std::make_shared<std::thread>([this] { worker_ios_.run(); }));
+                }
+
+                router_.set_executor([this](std::function<void()> task) {
+                    worker_queue_depth_++;
+                    worker_ios_.post([this, task] {
+                        worker_queue_depth_--;
+                        task();
+                    });
+                });
+            }
+
+            // stream handlers block on their stream for the whole transfer, at most size of them run
+            // at once on threads of the server, later streams wait for one of them. Call it before
+            // register_stream_handler.
+            void set_stream_threads(size_t size) {
+                if (size != 0 && stream_threads_.empty()) {
+                    stream_thread_count_ = size;
+                }
             }
 
             void async_run() {
@@ -64,6 +117,11 @@ namespace rest_rpc {
                 io_service_pool_.run();
             }
 
+            // the event loops of the server, rpc_clients of the same process may share them
+            io_service_pool& get_io_service_pool() {
+                return io_service_pool_;
+            }
+
             template<ExecMode model = ExecMode::sync, typename Function>
             void register_handler(std::string const& name, const Function& f) {
                 router_.register_handler<model>(name, f);
@@ -74,6 +132,172 @@ namespace rest_rpc {
                 router_.register_handler<model>(name, f, self);
             }
 
+            // opt-in: hold the responses of a connection up to delay_microseconds or max_bytes
+            // and write them at once, for chatty connections with many tiny responses.
+            void set_response_coalescing(size_t delay_microseconds, size_t max_bytes = 64 * 1024) {
+                coalesce_delay_ = std::chrono::microseconds(delay_microseconds);
+                coalesce_bytes_ = max_bytes;
+            }
+
+            // a connection stops reading requests while more than high_water bytes of its responses
+            // are not written yet, and resumes below low_water. 0 disables it.
+            void set_read_backpressure(size_t high_water, size_t low_water) {
+                high_water_ = high_water;
+                low_water_ = low_water;
+            }
+
+            // caps the memory of large request bodies being received or processed, all connections
+            // together; a request that doesn't fit is skipped and answered with result_code::OVERLOADED,
+            // other frames close their connection. Keep it a multiple of the max frame size. 0 means unlimited.
+            void set_receive_memory_limit(size_t bytes) {
+                buffer_pool_.set_max_receive_bytes(bytes);
+            }
+
+            // released receive buffers kept for reuse
+            void set_buffer_pool_size(size_t bytes) {
+                buffer_pool_.set_max_pooled_bytes(bytes);
+            }
+
+            size_t receive_memory() const {
+                return buffer_pool_.receive_bytes();
+            }
+
+            // conn_id -> bytes held in its receive buffer and write queue
+            std::unordered_map<int64_t, size_t> get_buffer_footprints() {
+                std::lock_guard<std::mutex> lock(mtx_);
+                std::unordered_map<int64_t, size_t> footprints;
+                for (auto& conn : connections_) {
+                    footprints.emplace(conn.first, conn.second->buffer_footprint());
+                }
+                return footprints;
+            }
+
+            // bytes, applies to the connections accepted afterwards; clients with a smaller
+            // limit lower it for their connection when they connect.
+            void set_max_frame_size(size_t bytes) {
+                max_frame_size_ = (std::min)(bytes, MAX_FRAME_LIMIT);
+            }
+
+            // compress results of at least threshold bytes for clients offering a codec this
+            // build supports (REST_RPC_ENABLE_LZ4, REST_RPC_ENABLE_ZSTD)
+            void enable_compression(size_t threshold = COMPRESS_THRESHOLD) {
+                compress_threshold_ = threshold;
+            }
+
+            // connections accepted over this number are closed right away, 0 means unlimited
+            void set_max_connections(size_t n) {
+                max_connections_ = n;
+            }
+
+            // requests admitted and not answered yet, over which new ones are rejected with
+            // result_code::OVERLOADED: server wide, per connection and per method. 0 means unlimited.
+            void set_max_requests(size_t n) {
+                admission_.set_max_requests(n);
+            }
+
+            void set_max_connection_requests(size_t n) {
+                admission_.set_max_connection_requests(n);
+            }
+
+            void set_method_limit(const std::string& name, size_t n) {
+                admission_.set_method_limit(name, n);
+            }
+
+            // adapt the server wide limit within [min_limit, max_limit] to the observed latency,
+            // see admission_control
+            void enable_adaptive_limit(size_t min_limit, size_t max_limit, double tolerance = 2.0) {
+                admission_.enable_adaptive_limit(min_limit, max_limit, tolerance);
+            }
+
+            uint64_t rejected_requests() const {
+                return admission_.rejected();
+            }
+
+            // the server wide request limit now, 0 if unlimited
+            size_t request_limit() const {
+                return admission_.limit();
+            }
+
+            // per-method call counts, errors, bytes and latency histograms, on by default
+            void enable_metrics(bool enable) {
+                router_.enable_metrics(enable);
+            }
+
+            // the methods called so far, merged from all the threads
+            std::vector<method_metrics> get_method_metrics() const {
+                return router_.get_metrics();
+            }
+
+            // log the requests whose handler or total latency reaches threshold, see slow_request_log;
+            // call them before run()
+            void set_slow_request_threshold(std::chrono::microseconds threshold) {
+                router_.slow_log().set_threshold(threshold);
+            }
+
+            void set_slow_request_threshold(const std::string& name, std::chrono::microseconds threshold) {
+                router_.slow_log().set_threshold(name, threshold);
+            }
+
+            // replaces printing to stdout, max_args_bytes 0 doesn't decode the arguments
+            void set_slow_request_logger(std::function<void(const slow_request&)> logger,
+                size_t max_per_second = SLOW_LOG_MAX_PER_SECOND, size_t max_args_bytes = SLOW_LOG_MAX_ARGS) {
+                router_.slow_log().set_logger(std::move(logger), max_per_second, max_args_bytes);
+            }
+
+            // requests dropped unexecuted because the client's deadline had passed
+            uint64_t expired_requests() const {
+                return router_.expired_requests();
+            }
+
+            // requests dropped unexecuted because the client cancelled them
+            uint64_t cancelled_requests() const {
+                return router_.cancelled_requests();
+            }
+
+            write_stats get_write_stats() {
+                std::lock_guard<std::mutex> lock(mtx_);
+                write_stats stats;
+                for (auto& conn : connections_) {
+                    stats += conn.second->get_write_stats();
+                }
+                return stats;
+            }
+
+            // the server wide counters and gauges with a summary of each method, also returned by
+            // the built-in STATS_RPC_NAME rpc
+            server_stats get_stats() {
+                server_stats stats;
+                stats.values = get_stat_values();
+                stats.methods = summarize(router_.get_metrics());
+                return stats;
+            }
+
+            // write the flight recorder to path when the process gets signal_number, e.g. SIGUSR2;
+            // as Chrome trace JSON if path ends with .json, else binary. Call it before run().
+            void enable_flight_recorder_dump(int signal_number, std::string path) {
+                dump_signals_.reset(new boost::asio::signal_set(io_service_pool_.get_io_service(), signal_number));
+                wait_dump_signal(std::move(path));
+            }
+
+            // the events of the flight recorder, see flight_recorder
+            std::vector<flight_event> get_flight_events() const {
+                return get_flight_recorder().snapshot();
+            }
+
+            // serve the metrics in the Prometheus text format on http://host:port/metrics, on one of
+            // the io threads. Call it before run().
+            void enable_metrics_http(unsigned short port) {
+                metrics_http_.reset(new metrics_http_server(io_service_pool_.get_io_service(), port, [this] {
+                    return to_prometheus(get_stat_values(), router_.get_metrics());
+                }));
+            }
+
+            template<typename Function>
+            void register_stream_handler(std::string const& name, const Function& f) {
+                start_stream_threads();
+                router_.register_stream_handler(name, f);
+            }
+
             void set_conn_timeout_callback(std::function<void(int64_t)> callback) {
                 conn_timeout_callback_ = std::move(callback);
             }
@@ -94,8 +318,91 @@ namespace rest_rpc {
             }
 
         private:
+            void start_stream_threads() {
+                if (!stream_threads_.empty()) {
+                    return;
+                }
+
+                stream_work_ = std::make_shared<boost::asio::io_service::work>(stream_ios_);
+                for (size_t i = 0; i < stream_thread_count_; ++i) {
+                    stream_threads_.emplace_back(std::make_shared<std::thread>([this] { stream_ios_.run(); }));
+                }
+
+                router_.set_stream_executor([this](std::function<void()> task) {
+                    stream_ios_.post(std::move(task));
+                });
+            }
+
+            server_stats stats_rpc(rpc_conn) {
+                return get_stats();
+            }
+
+            std::string flight_recorder_rpc(rpc_conn, const std::string& format) {
+                auto events = get_flight_recorder().snapshot();
+                return format == "json" ? flight_recorder::to_chrome_trace(events, method_names()) : flight_recorder::to_binary(events);
+            }
+
+            std::unordered_map<uint32_t, std::string> method_names() const {
+                std::unordered_map<uint32_t, std::string> names;
+                for (auto& name : router_.handler_names()) {
+                    names.emplace(method_id(name.data(), name.size()), name);
+                }
+                return names;
+            }
+
+            void wait_dump_signal(std::string path) {
+                dump_signals_->async_wait([this, path](const boost::system::error_code& ec, int) {
+                    if (ec) {
+                        return;
+                    }
+
+                    if (!get_flight_recorder().dump(path, method_names())) {
+                        std::cout << "flight recorder dump to " << path << " failed" << std::endl;
+                    }
+                    wait_dump_signal(path);
+                });
+            }
+
+            std::map<std::string, uint64_t> get_stat_values() {
+                std::map<std::string, uint64_t> values;
+                write_stats writes;
+                size_t open_connections = 0;
+                size_t connection_buffers = 0;
+                {
+                    std::lock_guard<std::mutex> lock(mtx_);
+                    writes = closed_writes_;
+                    for (auto& conn : connections_) {
+                        if (!conn.second->has_closed()) {
+                            open_connections++;
+                        }
+                        writes += conn.second->get_write_stats();
+                        connection_buffers += conn.second->buffer_footprint();
+                    }
+                }
+
+                values["connections"] = open_connections;
+                values["connection_buffer_bytes"] = connection_buffers;
+                values["requests_inflight"] = admission_.requests();
+                values["request_limit"] = admission_.limit();
+                values["worker_queue_depth"] = worker_queue_depth_;
+                values["receive_memory_bytes"] = buffer_pool_.receive_bytes();
+                values["pooled_buffer_bytes"] = buffer_pool_.pooled_bytes();
+                values["receive_memory_rejected_total"] = buffer_pool_.rejected();
+                values["rejected_requests_total"] = admission_.rejected();
+                values["expired_requests_total"] = router_.expired_requests();
+                values["cancelled_requests_total"] = router_.cancelled_requests();
+                values["socket_writes_total"] = writes.writes;
+                values["written_messages_total"] = writes.messages;
+                values["written_bytes_total"] = writes.bytes;
+                values["max_write_batch"] = writes.max_batch;
+                values["read_pauses_total"] = writes.read_pauses;
+                values["slow_requests_total"] = router_.slow_log().slow_requests();
+                values["slow_requests_suppressed_total"] = router_.slow_log().suppressed();
+                return values;
+            }
+
             void do_accept() {
-                conn_.reset(new connection(io_service_pool_.get_io_service(), timeout_seconds_, router_));
+                conn_.reset(new connection(io_service_pool_.get_io_service(), timeout_seconds_, router_, buffer_pool_, admission_));
                 conn_->set_callback([this](std::string key, std::string token, std::weak_ptr<connection> conn) {
                     std::lock_guard<std::mutex> lock(sub_mtx_);
                     sub_map_.emplace(std::move(key) + token, conn);
@@ -113,6 +420,19 @@ namespace rest_rpc {
                             conn_->init_ssl_context(ssl_conf_);
                         }
 #endif
+                        if (coalesce_delay_.count() > 0) {
+                            conn_->set_response_coalescing(coalesce_delay_, coalesce_bytes_);
+                        }
+                        if (!has_connection_room()) {
+                            boost::system::error_code ignored_ec;
+                            conn_->socket().close(ignored_ec);
+                            do_accept();
+                            return;
+                        }
+
+                        conn_->set_max_frame_size(max_frame_size_);
+                        conn_->set_read_backpressure(high_water_, low_water_);
+                        conn_->set_compression_threshold(compress_threshold_);
                         conn_->start();
                         {
                             std::lock_guard<std::mutex> lock(mtx_);
@@ -125,6 +445,32 @@ namespace rest_rpc {
                 });
             }
 
+            // closed connections are only removed by clean(), drop them first when at the limit
+            bool has_connection_room() {
+                if (max_connections_ == 0) {
+                    return true;
+                }
+
+                std::lock_guard<std::mutex> lock(mtx_);
+                if (connections_.size() < max_connections_) {
+                    return true;
+                }
+
+                for (auto it = connections_.cbegin(); it != connections_.cend();) {
+                    if (it->second->has_closed()) {
+                        if (conn_timeout_callback_) {
+                            conn_timeout_callback_(it->second->conn_id());
+                        }
+                        closed_writes_ += it->second->get_write_stats();
+                        it = connections_.erase(it);
+                    }
+                    else {
+                        ++it;
+                    }
+                }
+                return connections_.size() < max_connections_;
+            }
+
             void clean() {
                 while (!stop_check_) {
                     std::unique_lock<std::mutex> lock(mtx_);
@@ -135,6 +481,7 @@ namespace rest_rpc {
                             if (conn_timeout_callback_) {
                                 conn_timeout_callback_(it->second->conn_id());
                             }
+                            closed_writes_ += it->second->get_write_stats();
                             it = connections_.erase(it);
                         }
                         else {
@@ -193,13 +540,18 @@ namespace rest_rpc {
                 return std::make_shared<std::string>(buf.data(), buf.size());
             }
 
+            buffer_pool buffer_pool_;
+            admission_control admission_;
             io_service_pool io_service_pool_;
             tcp::acceptor acceptor_;
+            std::unique_ptr<metrics_http_server> metrics_http_;
+            std::unique_ptr<boost::asio::signal_set> dump_signals_;
             std::shared_ptr<connection> conn_;
             std::shared_ptr<std::thread> thd_;
             std::size_t timeout_seconds_;
 
             std::unordered_map<int64_t, std::shared_ptr<connection>> connections_;
+            write_stats closed_writes_;  // of the connections removed from connections_, the totals never go down
             int64_t conn_id_ = 0;
             std::mutex mtx_;
             std::shared_ptr<std::thread> check_thread_;
@@ -207,6 +559,14 @@ namespace rest_rpc {
             bool stop_check_ = false;
             std::condition_variable cv_;
 
+            std::chrono::microseconds coalesce_delay_{ 0 };
+            size_t coalesce_bytes_ = 0;
+            size_t max_frame_size_ = MAX_BUF_LEN;
+            size_t compress_threshold_ = 0;
+            size_t max_connections_ = 0;
+            size_t high_water_ = WRITE_QUEUE_HIGH_WATER;
+            size_t low_water_ = WRITE_QUEUE_LOW_WATER;
+
             std::function<void(int64_t)> conn_timeout_callback_;
             std::unordered_multimap<std::string, std::weak_ptr<connection>> sub_map_;
             std::set<std::string> token_list_;
@@ -216,6 +576,16 @@ namespace rest_rpc {
             std::shared_ptr<std::thread> pub_sub_thread_;
             bool stop_check_pub_sub_ = false;
 
+            boost::asio::io_service worker_ios_;
+            std::shared_ptr<boost::asio::io_service::work> worker_work_;
+            std::vector<std::shared_ptr<std::thread>> worker_threads_;
+            std::atomic<size_t> worker_queue_depth_{ 0 };  // tasks posted and not started yet
+
+            boost::asio::io_service stream_ios_;
+            std::shared_ptr<boost::asio::io_service::work> stream_work_;
+            std::vector<std::shared_ptr<std::thread>> stream_threads_;
+            size_t stream_thread_count_ = STREAM_HANDLER_THREADS;
+
             ssl_configure ssl_conf_;
             router router_;
         };
@@ -0,0 +1,139 @@
+#ifndef REST_RPC_SLOW_LOG_H_
+#define REST_RPC_SLOW_LOG_H_
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <unordered_map>
+#include "use_asio.hpp"
+
+namespace rest_rpc {
+    namespace rpc_service {
+        struct slow_request {
+            std::string method;
+            int64_t conn_id;
+            std::string remote_address;
+            size_t request_bytes;
+            size_t response_bytes;
+            std::chrono::steady_clock::duration queue;    // waiting for a worker
+            std::chrono::steady_clock::duration handler;
+            std::chrono::steady_clock::duration total;    // from the request being read to its result being packed
+            std::string args;  // the decoded request, truncated, empty unless captured
+        };
+
+        static const size_t SLOW_LOG_MAX_PER_SECOND = 10;
+        static const size_t SLOW_LOG_MAX_ARGS = 256;  // bytes of decoded arguments kept
+
+        inline void print_slow_request(const slow_request& r) {
+            using std::chrono::duration_cast;
+            using std::chrono::microseconds;
+            std::cout << "slow request " << r.method << " conn " << r.conn_id << " from " << r.remote_address
+                << ": total " << duration_cast<microseconds>(r.total).count() << "us, handler "
+                << duration_cast<microseconds>(r.handler).count() << "us, queue "
+                << duration_cast<microseconds>(r.queue).count() << "us, request " << r.request_bytes
+                << " bytes, response " << r.response_bytes << " bytes";
+            if (!r.args.empty()) {
+                std::cout << ", args " << r.args;
+            }
+            std::cout << std::endl;
+        }
+
+        /**
+         * Reports the requests whose handler or total latency reached the threshold of their method,
+         * at most max_per_second of them, the others are only counted. Configure it before the server
+         * runs, thresholds are read without a lock.
+         */
+        class slow_request_log : private asio::noncopyable {
+        public:
+            // for the methods without a threshold of their own, 0 disables
+            void set_threshold(std::chrono::microseconds threshold) {
+                default_threshold_ = threshold;
+                update_enabled();
+            }
+
+            // overrides the default threshold for name, 0 removes the override
+            void set_threshold(const std::string& name, std::chrono::microseconds threshold) {
+                if (threshold.count() == 0) {
+                    thresholds_.erase(name);
+                }
+                else {
+                    thresholds_[name] = threshold;
+                }
+                update_enabled();
+            }
+
+            // max_args_bytes of the decoded arguments are logged, 0 to not decode them
+            void set_logger(std::function<void(const slow_request&)> logger, size_t max_per_second = SLOW_LOG_MAX_PER_SECOND,
+                size_t max_args_bytes = SLOW_LOG_MAX_ARGS) {
+                logger_ = std::move(logger);
+                max_per_second_ = max_per_second;
+                max_args_bytes_ = max_args_bytes;
+            }
+
+            bool enabled() const { return enabled_; }
+
+            // zero if requests of name aren't watched
+            std::chrono::microseconds threshold(const std::string& name) const {
+                if (thresholds_.empty()) {
+                    return default_threshold_;
+                }
+
+                auto it = thresholds_.find(name);
+                return it == thresholds_.end() ? default_threshold_ : it->second;
+            }
+
+            size_t max_args_bytes() const { return max_args_bytes_; }
+
+            // counts a slow request, false if it is over the rate limit and isn't to be logged
+            bool admit() {
+                slow_++;
+                auto second = (uint64_t)std::chrono::duration_cast<std::chrono::seconds>(
+                    std::chrono::steady_clock::now().time_since_epoch()).count();
+                auto window = window_.load();
+                if (window != second && window_.compare_exchange_strong(window, second)) {
+                    logged_in_window_ = 0;
+                }
+
+                if (max_per_second_ != 0 && logged_in_window_++ >= max_per_second_) {
+                    suppressed_++;
+                    return false;
+                }
+                return true;
+            }
+
+            void log(const slow_request& request) {
+                if (logger_) {
+                    logger_(request);
+                }
+                else {
+                    print_slow_request(request);
+                }
+            }
+
+            uint64_t slow_requests() const { return slow_; }
+
+            // slow requests not logged because of the rate limit
+            uint64_t suppressed() const { return suppressed_; }
+
+        private:
+            void update_enabled() {
+                enabled_ = default_threshold_.count() != 0 || !thresholds_.empty();
+            }
+
+            std::atomic<bool> enabled_ = { false };
+            std::chrono::microseconds default_threshold_{ 0 };
+            std::unordered_map<std::string, std::chrono::microseconds> thresholds_;
+            std::function<void(const slow_request&)> logger_;
+            size_t max_per_second_ = SLOW_LOG_MAX_PER_SECOND;
+            size_t max_args_bytes_ = SLOW_LOG_MAX_ARGS;
+            std::atomic<uint64_t> window_ = { 0 };
+            std::atomic<size_t> logged_in_window_ = { 0 };
+            std::atomic<uint64_t> slow_ = { 0 };
+            std::atomic<uint64_t> suppressed_ = { 0 };
+        };
+    }  // namespace rpc_service
+}  // namespace rest_rpc
+
+#endif  // REST_RPC_SLOW_LOG_H_
@@ -0,0 +1,142 @@
+#ifndef REST_RPC_STATS_H_
+#define REST_RPC_STATS_H_
+
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include "codec.h"
+#include "metrics.h"
+
+namespace rest_rpc {
+    namespace rpc_service {
+        struct phase_summary {
+            std::string phase;
+            uint64_t count;
+            uint64_t sum_ns;
+            uint64_t p50_ns;
+            uint64_t p90_ns;
+            uint64_t p99_ns;
+            uint64_t p999_ns;
+            MSGPACK_DEFINE(phase, count, sum_ns, p50_ns, p90_ns, p99_ns, p999_ns);
+        };
+
+        struct method_summary {
+            std::string name;
+            uint64_t calls;
+            uint64_t errors;
+            uint64_t request_bytes;
+            uint64_t response_bytes;
+            std::vector<phase_summary> phases;
+            MSGPACK_DEFINE(name, calls, errors, request_bytes, response_bytes, phases);
+        };
+
+        /**
+         * What the __stats rpc returns. values holds the server wide counters and gauges, the names
+         * of counters end with _total.
+         */
+        struct server_stats {
+            std::map<std::string, uint64_t> values;
+            std::vector<method_summary> methods;
+            MSGPACK_DEFINE(values, methods);
+        };
+
+        inline std::vector<method_summary> summarize(const std::vector<method_metrics>& metrics) {
+            std::vector<method_summary> result;
+            for (auto& m : metrics) {
+                method_summary summary{ m.name, m.calls, m.errors, m.request_bytes, m.response_bytes, {} };
+                for (size_t i = 0; i < METRIC_PHASES; ++i) {
+                    auto& h = m.latency[i];
+                    if (h.count() == 0) {
+                        continue;
+                    }
+
+                    summary.phases.push_back(phase_summary{ phase_name((metric_phase)i), h.count(),
+                        (uint64_t)h.sum().count(), (uint64_t)h.percentile(0.5).count(), (uint64_t)h.percentile(0.9).count(),
+                        (uint64_t)h.percentile(0.99).count(), (uint64_t)h.percentile(0.999).count() });
+                }
+                result.push_back(std::move(summary));
+            }
+            return result;
+        }
+
+        // upper bounds of the exported histogram buckets, in seconds
+        static const double PROMETHEUS_BUCKETS[] = { 0.00001, 0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005,
+            0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10 };
+
+        // a label value of the text exposition with backslashes, quotes and newlines escaped
+        inline std::string prometheus_label(const std::string& value) {
+            std::string out;
+            out.reserve(value.size());
+            for (char c : value) {
+                switch (c) {
+                case '\\': out += "\\\\"; break;
+                case '"': out += "\\\""; break;
+                case '\n': out += "\\n"; break;
+                default: out += c; break;
+                }
+            }
+            return out;
+        }
+
+        /**
+         * The Prometheus text exposition of values and of the per-method metrics, the latency
+         * histograms are folded into PROMETHEUS_BUCKETS.
+         */
+        inline std::string to_prometheus(const std::map<std::string, uint64_t>& values,
+            const std::vector<method_metrics>& metrics) {
+            std::string out;
+            out.reserve(4096 + metrics.size() * 8192);
+            for (auto& v : values) {
+                auto& name = v.first;
+                bool counter = name.size() > 6 && name.compare(name.size() - 6, 6, "_total") == 0;
+                out += "# TYPE rest_rpc_" + name + (counter ? " counter\n" : " gauge\n");
+                out += "rest_rpc_" + name + " " + std::to_string(v.second) + "\n";
+            }
+
+            auto method_counter = [&](const char* name, uint64_t method_metrics::*field) {
+                out += std::string("# TYPE rest_rpc_method_") + name + " counter\n";
+                for (auto& m : metrics) {
+                    out += std::string("rest_rpc_method_") + name + "{method=\"" + prometheus_label(m.name) + "\"} "
+                        + std::to_string(m.*field) + "\n";
+                }
+            };
+            method_counter("calls_total", &method_metrics::calls);
+            method_counter("errors_total", &method_metrics::errors);
+            method_counter("request_bytes_total", &method_metrics::request_bytes);
+            method_counter("response_bytes_total", &method_metrics::response_bytes);
+
+            out += "# TYPE rest_rpc_method_duration_seconds histogram\n";
+            char number[32];  // a %g bound or the %.9f seconds of a uint64 of nanoseconds
+            for (auto& m : metrics) {
+                for (size_t i = 0; i < METRIC_PHASES; ++i) {
+                    auto& h = m.latency[i];
+                    if (h.count() == 0) {
+                        continue;
+                    }
+
+                    auto labels = "{method=\"" + prometheus_label(m.name) + "\",phase=\"" + phase_name((metric_phase)i) + "\"";
+                    auto& buckets = h.buckets();
+                    uint64_t cumulative = 0;
+                    size_t b = 0;
+                    for (double bound : PROMETHEUS_BUCKETS) {
+                        // a bucket of the histogram counts under the first bound above its values
+                        while (b < HISTOGRAM_BUCKETS && latency_histogram::upper_bound(b) <= (uint64_t)(bound * 1e9)) {
+                            cumulative += buckets[b++];
+                        }
+                        snprintf(number, sizeof(number), "%g", bound);
+                        out += "rest_rpc_method_duration_seconds_bucket" + labels + ",le=\"" + number + "\"} "
+                            + std::to_string(cumulative) + "\n";
+                    }
+                    out += "rest_rpc_method_duration_seconds_bucket" + labels + ",le=\"+Inf\"} " + std::to_string(h.count()) + "\n";
+                    snprintf(number, sizeof(number), "%.9f", h.sum().count() / 1e9);
+                    out += "rest_rpc_method_duration_seconds_sum" + labels + "} " + number + "\n";
+                    out += "rest_rpc_method_duration_seconds_count" + labels + "} " + std::to_string(h.count()) + "\n";
+                }
+            }
+            return out;
+        }
+    }  // namespace rpc_service
+}  // namespace rest_rpc
+
+#endif  // REST_RPC_STATS_H_
@@ -0,0 +1,267 @@
+#ifndef REST_RPC_STREAM_H_
+#define REST_RPC_STREAM_H_
+
+#include <chrono>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <string>
+#include <functional>
+#include "use_asio.hpp"
+#include "const_vars.h"
+#include "codec.h"
+
+namespace rest_rpc {
+    /**
+     * One side of a streaming rpc. Both peers read and write chunks until they finish their
+     * side, so the same object serves client-stream, server-stream and bidi calls.
+     * Flow control: a writer may have at most `window` unacknowledged bytes in flight, the
+     * reader acknowledges what it consumed, so memory stays constant whatever the payload size.
+     * read/write block, don't call them on an io thread; they fail the stream once they waited
+     * longer than the timeout for the peer.
+     */
+    class rpc_stream : private asio::noncopyable {
+    public:
+        using sender_type = std::function<void(request_type, std::string)>;
+
+        rpc_stream(uint64_t id, sender_type sender, size_t window = STREAM_WINDOW)
+            : id_(id), sender_(std::move(sender)), window_(window), credit_(window) {
+        }
+
+        uint64_t id() const { return id_; }
+
+        // keep data frames under the connection's max frame size
+        void set_max_chunk_size(size_t size) { max_chunk_ = size; }
+
+        // how long read and write wait for the peer's data or acks, 0 waits forever
+        void set_timeout(std::chrono::milliseconds timeout) {
+            std::unique_lock<std::mutex> lock(mtx_);
+            timeout_ = timeout;
+        }
+
+        // wait for the next chunk, false once the peer finished or the stream was aborted
+        bool read(std::string& chunk) {
+            std::unique_lock<std::mutex> lock(mtx_);
+            if (!wait(lock, [this] { return !chunks_.empty() || remote_done_; })) {
+                lock.unlock();
+                time_out();
+                return false;
+            }
+            if (chunks_.empty()) {
+                return false;
+            }
+
+            chunk = std::move(chunks_.front());
+            chunks_.pop_front();
+            queued_bytes_ -= chunk.size();
+            consumed_ += chunk.size();
+            if (consumed_ < window_ / 2 || remote_done_) {
+                return true;
+            }
+
+            auto consumed = consumed_;
+            consumed_ = 0;
+            lock.unlock();
+            auto ack = rpc_service::msgpack_codec::pack_args(consumed);
+            sender_(request_type::stream_ack, std::string(ack.data(), ack.size()));
+            return true;
+        }
+
+        // send a chunk, waiting while the peer's window is full; false if the stream is over
+        bool write(string_view chunk) {
+            while (!chunk.empty()) {
+                // the reader acks every half window, a bigger piece could wait forever
+                size_t size = (std::min)((std::min)(chunk.size(), window_ / 2), max_chunk_);
+                {
+                    std::unique_lock<std::mutex> lock(mtx_);
+                    if (!wait(lock, [this, size] { return credit_ >= size || local_done_ || aborted_; })) {
+                        // the peer stopped acknowledging
+                        lock.unlock();
+                        time_out();
+                        return false;
+                    }
+                    if (local_done_ || aborted_) {
+                        return false;
+                    }
+                    credit_ -= size;
+                }
+
+                sender_(request_type::stream_data, std::string(chunk.data(), size));
+                chunk = chunk.substr(size);
+            }
+
+            return true;
+        }
+
+        // finish our side, the peer reads the status once it has consumed the data
+        void finish(result_code code = result_code::OK, const std::string& message = "") {
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                if (local_done_) {
+                    return;
+                }
+                local_done_ = true;
+                cv_.notify_all();
+                if (aborted_) {
+                    return;
+                }
+            }
+
+            sender_(request_type::stream_end, rpc_service::msgpack_codec::pack_args_str(code, message));
+            check_done();
+        }
+
+        // the peer finished with an error, or the stream was aborted
+        bool has_error() const {
+            std::unique_lock<std::mutex> lock(mtx_);
+            return aborted_ || (remote_done_ && remote_code_ != result_code::OK);
+        }
+
+        std::string error_message() const {
+            std::unique_lock<std::mutex> lock(mtx_);
+            return error_message_;
+        }
+
+        // bytes received and not read yet, at most the window while the peer honours flow control
+        size_t queued_bytes() const {
+            std::unique_lock<std::mutex> lock(mtx_);
+            return queued_bytes_;
+        }
+
+        // called once both sides finished or the stream was aborted
+        void set_done_callback(std::function<void()> callback) {
+            std::unique_lock<std::mutex> lock(mtx_);
+            done_callback_ = std::move(callback);
+        }
+
+        void on_data(const char* data, size_t size) {
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                if (remote_done_) {
+                    return;
+                }
+
+                if (queued_bytes_ + size <= 2 * window_) {
+                    chunks_.emplace_back(data, size);
+                    queued_bytes_ += size;
+                    cv_.notify_all();
+                    return;
+                }
+            }
+
+            // the peer ignores flow control
+            finish(result_code::FAIL, "stream window exceeded");
+            abort("stream window exceeded");
+        }
+
+        void on_ack(const char* data, size_t size) {
+            rpc_service::msgpack_codec codec;
+            auto tp = codec.unpack<std::tuple<size_t>>(data, size);
+            std::unique_lock<std::mutex> lock(mtx_);
+            credit_ = (std::min)(window_, credit_ + std::get<0>(tp));
+            cv_.notify_all();
+        }
+
+        void on_end(const char* data, size_t size) {
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                try {
+                    rpc_service::msgpack_codec codec;
+                    auto tp = codec.unpack<std::tuple<int, std::string>>(data, size);
+                    remote_code_ = (result_code)std::get<0>(tp);
+                    error_message_ = std::move(std::get<1>(tp));
+                }
+                catch (const std::exception& ex) {
+                    remote_code_ = result_code::FAIL;
+                    error_message_ = ex.what();
+                }
+                remote_done_ = true;
+                cv_.notify_all();
+            }
+
+            check_done();
+        }
+
+        // the connection is gone, wake up the blocked reader and writer
+        void abort(const std::string& message) {
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                if (aborted_) {
+                    return;
+                }
+                aborted_ = true;
+                remote_done_ = true;
+                if (error_message_.empty()) {
+                    error_message_ = message;
+                }
+                cv_.notify_all();
+            }
+
+            notify_done();
+        }
+
+    private:
+        template<typename Predicate>
+        bool wait(std::unique_lock<std::mutex>& lock, Predicate ready) {
+            if (timeout_.count() == 0) {
+                cv_.wait(lock, ready);
+                return true;
+            }
+
+            return cv_.wait_for(lock, timeout_, ready);
+        }
+
+        // tell the peer and wake up the other side of this stream
+        void time_out() {
+            finish(result_code::FAIL, "stream timed out");
+            abort("stream timed out");
+        }
+
+        void check_done() {
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                if (!local_done_ || !remote_done_) {
+                    return;
+                }
+            }
+
+            notify_done();
+        }
+
+        void notify_done() {
+            std::function<void()> callback;
+            {
+                std::unique_lock<std::mutex> lock(mtx_);
+                callback.swap(done_callback_);
+            }
+
+            if (callback) {
+                callback();
+            }
+        }
+
+        uint64_t id_;
+        sender_type sender_;
+        size_t window_;
+        size_t credit_;
+        size_t max_chunk_ = MAX_BUF_LEN - 1;
+        std::chrono::milliseconds timeout_{ STREAM_TIMEOUT_MS };
+
+        mutable std::mutex mtx_;
+        std::condition_variable cv_;
+        std::deque<std::string> chunks_;
+        size_t queued_bytes_ = 0;
+        size_t consumed_ = 0;
+
+        bool local_done_ = false;
+        bool remote_done_ = false;
+        bool aborted_ = false;
+        result_code remote_code_ = result_code::OK;
+        std::string error_message_;
+        std::function<void()> done_callback_;
+    };
+
+    using stream_ptr = std::shared_ptr<rpc_stream>;
+}  // namespace rest_rpc
+
+#endif  // REST_RPC_STREAM_H_
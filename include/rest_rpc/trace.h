@@ -0,0 +1,156 @@
+#ifndef REST_RPC_TRACE_H_
+#define REST_RPC_TRACE_H_
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "event_ring.h"
+
+namespace rest_rpc {
+    // the step of a request a span measures
+    enum class span_kind : uint8_t {
+        client_call,  // the client's side: from queueing the request to reading its response
+        server,       // the server's side: from reading the header to queueing the response
+        read_header,  // an instant, when the header was read
+        read_body,
+        enqueue,      // waiting for a worker thread
+        decode,
+        handler,
+        encode,
+        write,        // from queueing the response to the socket write completing
+    };
+
+    inline const char* span_kind_name(span_kind kind) {
+        static const char* names[] = { "client_call", "server", "read_header", "read_body", "enqueue",
+            "decode", "handler", "encode", "write" };
+        return names[(size_t)kind];
+    }
+
+    struct span_record {
+        uint64_t trace_id;
+        uint64_t span_id;
+        uint64_t parent_id;  // 0 for the root span of a trace
+        uint64_t start_ns;   // system clock, nanoseconds since the epoch
+        uint64_t duration_ns;
+        uint32_t method_id;
+        span_kind kind;
+    };
+
+    // the span new spans of the calling thread are children of, trace_id 0 if none
+    struct trace_context {
+        uint64_t trace_id;
+        uint64_t span_id;
+    };
+
+    // set by the server while a traced request's handler runs, calls the handler makes with an
+    // rpc_client join the trace. Async handlers lose it once they return.
+    inline trace_context& current_trace() {
+        static thread_local trace_context context{};
+        return context;
+    }
+
+    static const size_t SPAN_RING_SIZE = 4096;  // spans kept per thread until collected, a power of two
+
+    /**
+     * Samples requests to trace and keeps the spans of the process, the client and the server
+     * record into it. Requests arriving with a trace context are traced whatever the rate; when it
+     * is 0, the cost for the others is one relaxed load.
+     */
+    class tracer {
+    public:
+        tracer(const tracer&) = delete;
+        tracer& operator=(const tracer&) = delete;
+
+        // the part of the calls started without a trace context which start one, in [0, 1]
+        void set_sample_rate(double rate) {
+            rate = (std::max)(0.0, (std::min)(rate, 1.0));
+            threshold_ = (uint64_t)(rate * (double)UINT32_MAX);
+        }
+
+        bool enabled() const {
+            return threshold_.load(std::memory_order_relaxed) != 0;
+        }
+
+        bool sample() {
+            auto threshold = threshold_.load(std::memory_order_relaxed);
+            return threshold != 0 && (random() & UINT32_MAX) <= threshold;
+        }
+
+        // a random id, never 0
+        static uint64_t new_id() {
+            uint64_t id;
+            do {
+                id = random();
+            } while (id == 0);
+            return id;
+        }
+
+        void record(span_kind kind, const trace_context& context, uint64_t span_id, uint32_t method,
+            std::chrono::steady_clock::time_point start, std::chrono::steady_clock::time_point end) {
+            span_record span{ context.trace_id, span_id, context.span_id, to_system_ns(start),
+                (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count(), method, kind };
+            local_ring().push(span);
+        }
+
+        // the spans recorded since the last collect, those overwritten meanwhile are lost
+        std::vector<span_record> collect() {
+            std::vector<span_record> spans;
+            std::unique_lock<std::mutex> lock(mtx_);
+            for (auto& ring : rings_) {
+                ring.second = ring.first->copy(spans, ring.second);
+            }
+            return spans;
+        }
+
+    private:
+        tracer() = default;
+        friend tracer& get_tracer();
+
+        static uint64_t random() {
+            static thread_local std::mt19937_64 engine(std::random_device{}() ^
+                (uint64_t)std::hash<std::thread::id>()(std::this_thread::get_id()));
+            return engine();
+        }
+
+        using span_ring = event_ring<span_record, SPAN_RING_SIZE>;
+
+        span_ring& local_ring() {
+            static thread_local std::shared_ptr<span_ring> ring;
+            if (ring == nullptr) {
+                ring = std::make_shared<span_ring>();
+                std::unique_lock<std::mutex> lock(mtx_);
+                rings_.emplace_back(ring, 0);
+            }
+            return *ring;
+        }
+
+        uint64_t to_system_ns(std::chrono::steady_clock::time_point t) const {
+            return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+                (t - steady_origin_) + system_origin_.time_since_epoch()).count();
+        }
+
+        std::atomic<uint64_t> threshold_{ 0 };
+        std::mutex mtx_;
+        // rings outlive their thread, the spans of an exited thread can still be collected;
+        // with the number of the first span not collected yet
+        std::vector<std::pair<std::shared_ptr<span_ring>, uint64_t>> rings_;
+        const std::chrono::steady_clock::time_point steady_origin_ = std::chrono::steady_clock::now();
+        const std::chrono::system_clock::time_point system_origin_ = std::chrono::system_clock::now();
+    };
+
+    // the tracer of the process, the rings are per thread so there is only one
+    inline tracer& get_tracer() {
+        static tracer t;
+        return t;
+    }
+}  // namespace rest_rpc
+
+#endif  // REST_RPC_TRACE_H_